@@ -1,6 +1,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <string.h>
@@ -15,710 +17,5514 @@
 #include <pthread.h>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <unordered_map> 
 #include <string>
 #include <dirent.h>
 #include <unordered_set>
+#include <map>
+#include <algorithm>
+#include <stdint.h>
+#include <atomic>
+#include <signal.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/xattr.h>
+#include <sys/random.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <linux/sockios.h>
+#include <coroutine>
+#include <time.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-#define SMALL_BUF_SIZE 1
 // each thread can allocate 16KiB of buffer space
 #define BUFFER_SIZE 16384
+// bodies of large objects are moved in chunks of up to this much
+#define MAX_CHUNK_SIZE (256 << 10)
+// O_DIRECT writes (-D) are made in multiples of this, from buffers aligned to it
+#define DIRECT_ALIGN 4096
+// room for the longest object path, "[replica root]/ab/cd/[name]" or "objects/ab/cd/[name]"
+#define PATH_SIZE 512
+// replica roots can't be longer than this, so their object paths always fit
+#define MAX_ROOT_LENGTH (PATH_SIZE - 32)
+// number of replica roots used by -r when none are given with -d
+#define DEFAULT_REPLICAS 3
+// extended attribute holding the digest of a replica, written once the replica is complete
+#define DIGEST_XATTR "user.httpserver.digest"
+// root of the sharded layout when redundancy is off
+#define SHARD_DIR "objects"
+// list of known files saved on shutdown, so the next startup doesn't have to scan
+#define MANIFEST_FILE ".manifest"
+#define MANIFEST_MAGIC "HTTPMAN1"
+// getdents64 batch size used by the startup scan
+#define SCAN_BUFFER_SIZE (1 << 20)
+// requests forwarded to a peer (-P) carry this header, so the peer serves them locally
+#define PEER_HEADER "X-Replica:"
+// seconds to wait on a peer before giving up on it
+#define PEER_TIMEOUT 5
+// bytes moved per splice call when relaying a body between sockets
+#define RELAY_CHUNK_SIZE 65536
+// front-end mode (-B), a backend is ejected after this many failed requests in a row
+#define BACKEND_EJECT_FAILURES 3
+// seconds an ejected backend is left alone before health checks can bring it back
+#define BACKEND_EJECT_TIME 10
+// seconds between health checks of the backends
+#define BACKEND_CHECK_INTERVAL 1
+#define BALANCE_LEAST_OUTSTANDING 0
+#define BALANCE_TWO_CHOICES 1
+// set on PUTs that move an object to its new owner in cluster mode (-C), the owner keeps
+// its own copy instead if it has one
+#define HANDOFF_HEADER "X-Handoff:"
+// points each cluster member gets on the ring
+#define CLUSTER_VNODES 64
+// connection timeouts are kept on a wheel of TIMER_SLOTS slots that turns once a tick,
+// deadlines further out than one turn wait for the next turn
+#define TIMER_TICK_MS 100
+#define TIMER_SLOTS 1024
+// default seconds to get a whole header once it has started, to go without body bytes
+// moving, and to wait for the next request on a keep-alive connection (-T)
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_BODY_TIMEOUT 30
+#define DEFAULT_IDLE_TIMEOUT 60
+// what a connection is waiting for, picks the timeout that applies to it
+#define PHASE_IDLE 0
+#define PHASE_HEADER 1
+#define PHASE_BODY 2
+#define NUM_PHASES 3
+// events the dispatcher takes from epoll at a time
+#define EPOLL_EVENTS 64
+// priority classes of waiting requests, picked from the method and the body or object size
+#define CLASS_SMALL 0
+#define CLASS_MEDIUM 1
+#define CLASS_BULK 2
+#define NUM_CLASSES 3
+// largest body or object of a small request, and of a medium one
+#define SMALL_REQUEST_SIZE (256 << 10)
+#define MEDIUM_REQUEST_SIZE (16 << 20)
+// ticks a waiting request takes to move up a class, so bulk requests aren't starved
+#define AGING_TICKS 10
+// bytes a bulk request moves between checks for small requests to serve, and the most
+// small requests it lets through at each check
+#define SLICE_BYTES (1 << 20)
+#define SLICE_REQUESTS 8
+// how often the pool manager looks at the workers, a worker is added when requests wait in
+// the deques this long on average or when every worker is busy and mostly blocked, and a
+// worker that has had nothing to do for POOL_IDLE_SECONDS exits
+#define POOL_INTERVAL_MS 100
+#define POOL_GROW_WAIT_US 5000
+#define POOL_GROW_BLOCKED_PERCENT 50
+#define POOL_IDLE_SECONDS 10
+// path GETs of the server's counters are sent to
+#define METRICS_PATH "/metrics"
+// I/O buffers and coroutine frames come from per-thread free lists in size classes of
+// BUFFER_MIN_SIZE << c, carved from BUFFER_CHUNK_SIZE chunks; a thread keeps up to two
+// batches of BUFFER_BATCH_BYTES of a class and trades the rest with the shared lists
+#define NUM_BUFFER_CLASSES 13
+#define BUFFER_MIN_SIZE 64
+#define BUFFER_CHUNK_SIZE (256 << 10)
+#define BUFFER_BATCH_BYTES (64 << 10)
+#define CACHE_LINE_SIZE 64
+// objects a slab allocates at a time
+#define SLAB_CHUNK_OBJECTS 256
+// ranges a GET can ask for at once, a Range header with more is ignored
+#define MAX_RANGES 16
+// separates the parts of a multipart/byteranges response
+#define RANGE_BOUNDARY "d1e5c0a7b3f24968"
+// room kept for the value of a conditional header, a longer one is ignored
+#define CONDITION_SIZE 128
+// room for the Range and conditional headers a request is passed on with
+#define CONDITION_LINES_SIZE (MAX_RANGES * 48 + 3 * (CONDITION_SIZE + 32))
+// longest chunk size or trailer line of a chunked body
+#define CHUNK_LINE_SIZE 256
 
 using namespace std;
 
+// a range of a Range header, first is -1 for a suffix range of the last `last` bytes and
+// last is -1 for one that runs to the end of the object
+struct byte_range {
+    long first;
+    long last;
+};
+
 // http header
 struct header {
     char* command;
     char* resource_name;
-    int content_length;
+    long content_length;
+    // ranges asked for with Range: bytes=, 0 without one or with one that can't be parsed
+    int num_ranges;
+    struct byte_range ranges[MAX_RANGES];
+    // values of If-None-Match, If-Modified-Since and If-Range, empty without them
+    char if_none_match[CONDITION_SIZE];
+    char if_modified_since[CONDITION_SIZE];
+    char if_range[CONDITION_SIZE];
+    // set when the body is sent with Transfer-Encoding: chunked, or with a transfer coding
+    // that isn't understood
+    bool chunked;
+    bool unknown_encoding;
+    // set on requests forwarded by a peer, which are only served locally
+    bool from_peer;
+    // set on PUTs that hand an object over to its new owner in cluster mode
+    bool handoff;
+};
+
+// stored in DIGEST_XATTR of every full replica
+struct replica_digest {
+    uint64_t length;
+    // FNV-1a digest of the replica data
+    uint32_t digest;
+    uint32_t reserved;
+    // inode and modification time of the replica when the digest was stored, data written
+    // to it any other way changes the modification time and so voids the digest
+    uint64_t inode;
+    int64_t mtime_ns;
+};
+
+// erasure coded redundancy (-e)
+// each object is striped over EC_DATA_SHARDS data shards plus one XOR parity shard,
+// one shard in each replica root, so any EC_DATA_SHARDS of them can rebuild the object
+#define EC_MAGIC 0x31534345
+#define EC_DATA_SHARDS 2
+#define EC_PARITY_SHARDS 1
+#define EC_SHARDS (EC_DATA_SHARDS + EC_PARITY_SHARDS)
+// objects are striped in units of this many bytes
+#define EC_UNIT 4096
+
+// written at the start of every shard
+struct ec_header {
+    uint32_t magic;
+    // which shard this is, parity shards come after the data shards
+    uint8_t index;
+    uint8_t data_shards;
+    uint8_t parity_shards;
+    uint8_t reserved;
+    uint64_t object_length;
+    // bytes of shard data after the header, always a whole number of units
+    uint64_t shard_length;
+    // FNV-1a digest of the shard data
+    uint32_t digest;
+    // random id shared by the shards written by one PUT, so shards of different PUTs
+    // of the same length are never put back together
+    uint32_t write_id;
+};
+
+// log structured storage engine (-L)
+// objects are appended to segment files in LOG_DIR, and an in memory index maps
+// each name to the newest copy of its data
+#define LOG_DIR "log"
+#define LOG_RECORD_MAGIC 0x4c524543
+// a new segment is started once the active one grows past this size
+#define LOG_SEGMENT_SIZE (64 << 20)
+// sealed segments with less than this percent of live data get compacted
+#define LOG_COMPACT_PERCENT 50
+#define LOG_COMPACT_INTERVAL 5
+
+// written in front of the data of every object in a segment
+struct log_record {
+    uint32_t magic;
+    // 0 while the data is being written, 1 once it is complete
+    uint32_t committed;
+    // newest seq wins when the index is rebuilt
+    uint64_t seq;
+    uint64_t length;
+    uint32_t digest;
+    char name[12];
+};
+
+// where the newest copy of an object lives
+struct log_location {
+    uint32_t segment;
+    // offset of the log_record, the data starts right after it
+    uint64_t offset;
+    uint64_t length;
+    uint64_t seq;
+};
+
+struct log_store {
+    // protects everything below
+    pthread_mutex_t mutex;
+    // held for reading while a segment fd is in use, and for writing to close one
+    pthread_rwlock_t segments_rwlock;
+    
+    unordered_map<string, struct log_location> index;
+    // open fd of every segment, by segment number
+    map<uint32_t, int> segment_fds;
+    // bytes of live (indexed) records per segment
+    map<uint32_t, uint64_t> live_bytes;
+    // records reserved but not yet committed or released, per segment, a segment
+    // is never compacted while it has any since they aren't in the index yet
+    map<uint32_t, int> reserved;
+    
+    uint32_t active_segment;
+    uint64_t active_size;
+    uint64_t next_seq;
+};
+
+// a peer server that PUTs are forwarded to and GETs fail over to
+struct peer {
+    struct sockaddr_in addr;
+    // idle keep-alive connections to the peer
+    vector<int> idle_fds;
+    // protects idle_fds
+    pthread_mutex_t mutex;
+};
+
+// a backend server that requests are spread over in front-end mode (-B)
+struct backend {
+    struct peer conn;
+    // "host:port" as given on the command line
+    string id;
+    // requests sent to it that haven't been answered yet
+    atomic<int> outstanding;
+    // failed requests in a row
+    atomic<int> failures;
+    // false while ejected or failing health checks
+    atomic<bool> healthy;
+    // when it was last ejected
+    atomic<time_t> ejected_at;
+};
+
+// consistent hashing ring of the servers in a cluster (-C), each key is owned by the member
+// of the first vnode at or after the key's hash
+struct cluster {
+    // protects members, member_ids and ring, members are only ever added
+    pthread_rwlock_t rwlock;
+    vector<struct peer*> members;
+    // "ip:port" of each member, hashed to place its vnodes
+    vector<string> member_ids;
+    // sorted (hash, member index) pairs
+    vector<pair<uint32_t, int> > ring;
+    // index of this node in members
+    int self;
+    
+    // set when the ring has changed and keys may have to move
+    bool rebalance_needed;
+    pthread_mutex_t rebalance_mutex;
+    pthread_cond_t rebalance_cond;
+    atomic<unsigned long> keys_moved;
+};
+
+// objects of one size, cache line aligned, carved from chunks and kept on a free list once freed
+struct slab {
+    size_t object_size;
+    // protects everything below
+    pthread_mutex_t mutex;
+    // free objects, linked through their first bytes
+    void* free;
+    // objects handed out, and objects carved so far
+    long in_use;
+    long capacity;
+};
+
+// timer wheel of the client connections being served, turned by the reaper thread
+struct timer_wheel {
+    // protects slots
+    pthread_mutex_t mutex;
+    // connections due in each tick, by tick % TIMER_SLOTS
+    vector<struct connection*> slots[TIMER_SLOTS];
+    // ticks since startup
+    atomic<uint64_t> now;
+    // timeout of each phase in ticks, 0 if it has none
+    uint64_t timeouts[NUM_PHASES];
+    // connections closed for timing out, by phase
+    atomic<unsigned long> reaped[NUM_PHASES];
+    // where open_connection allocates connections, the reaper frees them
+    struct slab connections;
+};
+
+// a client connection being served by a worker
+struct connection {
+    int fd;
+    struct timer_wheel* wheel;
+    // PHASE_IDLE, PHASE_HEADER or PHASE_BODY
+    atomic<int> phase;
+    // tick the connection times out at, moved by the worker without touching the wheel
+    atomic<uint64_t> deadline;
+    // protects closed, so the reaper never shuts down an fd the worker has closed and reused
+    pthread_mutex_t mutex;
+    // set by the worker when it is done, the reaper frees the connection when it next sees it
+    bool closed;
+    // unsent bytes in the send buffer when the reaper last looked
+    int last_unsent;
+    
+    // class the dispatcher gave the waiting request, and the tick it was given it
+    int priority;
+    uint64_t ready_at;
+    // monotonic time in microseconds when the request was handed to the workers
+    uint64_t ready_us;
+    // object the waiting request is for, empty if it isn't known
+    char name[12];
+    // CPU the connection's packets are processed on, -1 if it isn't known
+    int cpu;
+    // coroutine of a request parked until the socket is ready or a worker is free, the
+    // worker that next takes the connection resumes it instead of starting a new request
+    coroutine_handle<> resume;
+};
+
+// connections with a request ready for one worker, by class, other workers steal from
+// the back when theirs is empty
+struct work_deque {
+    deque<struct connection*> items[NUM_CLASSES];
+    // protects items and changes to active
+    pthread_mutex_t mutex;
+    // set while a worker owns the deque, connections are only pushed to active deques
+    atomic<bool> active;
+};
+
+// the worker threads, grown and shrunk between min and max by the pool manager thread
+struct worker_pool {
+    int min;
+    int max;
+    // running workers, and the ones waiting for something to do, protected by idle_mutex
+    int size;
+    int idle;
+    // the worker owning each deque, NULL if none does, protected by idle_mutex
+    vector<struct worker_data*> workers;
+    // CPUs the workers are pinned to (-A), the worker on deque i gets cpus[i % cpus.size()],
+    // and the deques on each CPU; empty if workers aren't pinned
+    vector<int> cpus;
+    vector<vector<int> > cpu_deques;
+    
+    // time requests spent in the deques, added up until the manager next looks
+    atomic<uint64_t> wait_us;
+    atomic<uint64_t> waited;
+    // what the manager saw when it last looked
+    atomic<uint64_t> last_wait_us;
+    atomic<int> last_blocked_percent;
+    // resizes so far, and why the last one was made
+    atomic<unsigned long> grown;
+    atomic<unsigned long> shrunk;
+    atomic<const char*> last_resize;
 };
 
 // shared data amongst threads
 struct shared_data {
     // conditional variable for worker threads
     pthread_cond_t worker_cond;
+    // mutex idle workers wait on worker_cond with
+    pthread_mutex_t idle_mutex;
     // fileDescriptor for incoming connection requests
     int listen_fd;
-    // queue to store communication requests
-    queue<int> connections_queue;
-    // mutex lock for connections_queue access
-    pthread_mutex_t connections_queue_mutex;
+    // epoll set of the listening socket and the connections waiting for their next request
+    int epoll_fd;
+    // connections with a request ready, one deque per worker
+    vector<struct work_deque*> deques;
+    // connections in all of the deques
+    atomic<int> ready_count;
+    // deque the dispatcher hands the next connection to
+    atomic<unsigned int> next_deque;
+    struct worker_pool pool;
+    
+    // sizes of the objects PUT since startup, GETs for them are given a class by size
+    unordered_map<string, long> object_sizes;
+    pthread_mutex_t object_sizes_mutex;
+    // objects of the bulk requests being served in slices, small requests for them aren't
+    // let through in a slice since the bulk request may hold their file lock
+    unordered_multiset<string> sliced_names;
+    pthread_mutex_t sliced_names_mutex;
     
-    // maps file names to their respective mutex
+    // names of every file in the server, built on startup from the manifest or a scan
+    unordered_set<string> known_files;
+    // maps file names to their respective mutex, created the first time a file is used
     unordered_map<string, pthread_mutex_t> file_mutex_map;
+    // protects known_files and file_mutex_map
+    pthread_mutex_t file_mutex_map_mutex;
     
     bool redundancy;
+    // redundancy stores erasure coded shards instead of full copies
+    bool erasure;
+    // one directory per replica, copy number i lives in replica_roots[i-1]
+    vector<string> replica_roots;
+    // replicas that must be written for a PUT to succeed
+    int write_quorum;
+    // matching replicas needed before a GET is served
+    int read_quorum;
+    
+    // objects with divergent replicas, waiting for the repair thread
+    queue<string> repair_queue;
+    // names in repair_queue, so an object is only queued once
+    unordered_set<string> repair_pending;
+    // protects repair_queue and repair_pending
+    pthread_mutex_t repair_mutex;
+    pthread_cond_t repair_cond;
+    atomic<unsigned long> divergences_detected;
+    atomic<unsigned long> divergences_repaired;
+    
+    // objects are stored under two levels of hashed subdirectories (-S)
+    bool sharded;
+    // set while flat files are still being moved into the sharded layout
+    atomic<bool> migrating;
+    
+    // set when objects are kept in the log structured store instead of one file each
+    struct log_store* log;
+    
+    // peer servers every PUT is replicated to (-P)
+    vector<struct peer*> peers;
+    // copies, the local store included, that must acknowledge a PUT for it to succeed
+    int peer_quorum;
+    
+    // set when the keyspace is sharded over a cluster of servers
+    struct cluster* cluster;
+    
+    // backends requests are passed on to in front-end mode, nothing is stored locally
+    vector<struct backend*> backends;
+    // BALANCE_LEAST_OUTSTANDING or BALANCE_TWO_CHOICES
+    int balance_policy;
+    // where the next least outstanding search starts, so ties are spread around
+    atomic<unsigned int> next_backend;
+    
+    // timeouts of the client connections
+    struct timer_wheel timers;
+    
+    // numbers the temporary files PUTs are written to
+    atomic<unsigned long> next_temp;
+    // PUT bodies of at least this many bytes are written with O_DIRECT (-D), 0 if none are
+    long direct_put_size;
+};
+
+// a worker thread and the deque it takes connections from first
+struct worker_data {
+    struct shared_data* shared;
+    int index;
+    // set while serving a bulk request, which lets small requests through every SLICE_BYTES
+    bool slicing;
+    long slice_bytes;
+    char sliced_name[12];
+    
+    // time spent serving requests, and when the one being served started (0 while idle)
+    atomic<uint64_t> busy_us;
+    atomic<uint64_t> busy_since;
+    // clock of the thread's CPU time
+    clockid_t cpu_clock;
+    // busy and CPU time when the pool manager last looked
+    uint64_t last_busy_us;
+    uint64_t last_cpu_us;
+};
+
+// the worker running on this thread, NULL on every other thread
+__thread struct worker_data* current_worker = NULL;
+
+// allocates memory on the NUMA node of the CPU the calling thread runs on, fresh pages
+// are placed on the node of the CPU that first touches them, where malloc could hand back
+// memory another thread already touched
+void* alloc_local(size_t size) {
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        err(1, "mmap");
+    }
+    memset(memory, 0, size);
+    return memory;
+}
+
+void slab_init(struct slab* s, size_t object_size) {
+    s->object_size = (object_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    pthread_mutex_init(&s->mutex, NULL);
+    s->free = NULL;
+    s->in_use = 0;
+    s->capacity = 0;
+}
+
+void* slab_alloc(struct slab* s) {
+    pthread_mutex_lock(&s->mutex);
+    if (s->free == NULL) {
+        char* chunk = (char*) alloc_local(s->object_size * SLAB_CHUNK_OBJECTS);
+        for (int i = SLAB_CHUNK_OBJECTS - 1; i >= 0; i--) {
+            *(void**) (chunk + i * s->object_size) = s->free;
+            s->free = chunk + i * s->object_size;
+        }
+        s->capacity += SLAB_CHUNK_OBJECTS;
+    }
+    void* object = s->free;
+    s->free = *(void**) object;
+    s->in_use++;
+    pthread_mutex_unlock(&s->mutex);
+    return object;
+}
+
+void slab_free(struct slab* s, void* object) {
+    pthread_mutex_lock(&s->mutex);
+    *(void**) object = s->free;
+    s->free = object;
+    s->in_use--;
+    pthread_mutex_unlock(&s->mutex);
+}
+
+// a size class of the shared free lists, on a cache line of its own
+struct alignas(CACHE_LINE_SIZE) buffer_class {
+    pthread_mutex_t mutex;
+    // free blocks, linked through their first bytes
+    void* free;
+    long free_count;
+};
+
+// a thread's free lists, a thread that exits leaves its cache for the next new thread
+struct buffer_cache {
+    void* free[NUM_BUFFER_CLASSES];
+    int free_count[NUM_BUFFER_CLASSES];
+    // blocks of each class handed out, and times the thread went to the shared lists for
+    // more; only the owning thread changes them
+    atomic<unsigned long> allocs[NUM_BUFFER_CLASSES];
+    atomic<unsigned long> refills;
+    // protected by caches_mutex
+    bool in_use;
+    struct buffer_cache* next;
+};
+
+struct buffer_pool {
+    struct buffer_class classes[NUM_BUFFER_CLASSES];
+    // every cache ever made, so the counters can be added up
+    pthread_mutex_t caches_mutex;
+    struct buffer_cache* caches;
+    atomic<unsigned long> mapped_bytes;
+};
+
+// shared by every thread, coroutine frames are allocated without a shared_data at hand
+struct buffer_pool buffers;
+
+// the calling thread's cache, NULL until it first allocates
+__thread struct buffer_cache* thread_buffers = NULL;
+
+void init_buffer_pool() {
+    for (int c = 0; c < NUM_BUFFER_CLASSES; c++) {
+        pthread_mutex_init(&buffers.classes[c].mutex, NULL);
+        buffers.classes[c].free = NULL;
+        buffers.classes[c].free_count = 0;
+    }
+    pthread_mutex_init(&buffers.caches_mutex, NULL);
+    buffers.caches = NULL;
+    buffers.mapped_bytes = 0;
+}
+
+// smallest class that holds size bytes, -1 if it is too big for every class
+int buffer_class_of(size_t size) {
+    int c = 0;
+    while (c < NUM_BUFFER_CLASSES && ((size_t) BUFFER_MIN_SIZE << c) < size) {
+        c++;
+    }
+    return c < NUM_BUFFER_CLASSES ? c : -1;
+}
+
+// blocks of a class moved between a thread and the shared lists at a time
+int buffer_batch(int c) {
+    return max(1, BUFFER_BATCH_BYTES / (BUFFER_MIN_SIZE << c));
+}
+
+struct buffer_cache* get_thread_buffers() {
+    if (thread_buffers != NULL) {
+        return thread_buffers;
+    }
+    
+    pthread_mutex_lock(&buffers.caches_mutex);
+    struct buffer_cache* cache = buffers.caches;
+    while (cache != NULL && cache->in_use) {
+        cache = cache->next;
+    }
+    if (cache == NULL) {
+        cache = new struct buffer_cache;
+        for (int c = 0; c < NUM_BUFFER_CLASSES; c++) {
+            cache->free[c] = NULL;
+            cache->free_count[c] = 0;
+            cache->allocs[c] = 0;
+        }
+        cache->refills = 0;
+        cache->next = buffers.caches;
+        buffers.caches = cache;
+    }
+    cache->in_use = true;
+    pthread_mutex_unlock(&buffers.caches_mutex);
+    
+    thread_buffers = cache;
+    return cache;
+}
+
+// moves count blocks from the front of a thread's list to the shared list
+void spill_buffers(struct buffer_cache* cache, int c, int count) {
+    void* first = cache->free[c];
+    void* last = first;
+    for (int i = 1; i < count; i++) {
+        last = *(void**) last;
+    }
+    cache->free[c] = *(void**) last;
+    cache->free_count[c] -= count;
+    
+    struct buffer_class* shared_class = &buffers.classes[c];
+    pthread_mutex_lock(&shared_class->mutex);
+    *(void**) last = shared_class->free;
+    shared_class->free = first;
+    shared_class->free_count += count;
+    pthread_mutex_unlock(&shared_class->mutex);
+}
+
+// fills a thread's empty list with a batch from the shared list, or a new chunk if that is empty
+void refill_buffers(struct buffer_cache* cache, int c) {
+    cache->refills.store(cache->refills.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    
+    struct buffer_class* shared_class = &buffers.classes[c];
+    pthread_mutex_lock(&shared_class->mutex);
+    int count = 0;
+    while (count < buffer_batch(c) && shared_class->free != NULL) {
+        void* block = shared_class->free;
+        shared_class->free = *(void**) block;
+        *(void**) block = cache->free[c];
+        cache->free[c] = block;
+        count++;
+    }
+    shared_class->free_count -= count;
+    pthread_mutex_unlock(&shared_class->mutex);
+    cache->free_count[c] += count;
+    if (count > 0) {
+        return;
+    }
+    
+    // a chunk is page aligned, so every block of it starts on a cache line, and the blocks
+    // of a page or more on a page
+    size_t size = (size_t) BUFFER_MIN_SIZE << c;
+    size_t chunk_size = max((size_t) BUFFER_CHUNK_SIZE, size);
+    char* chunk = (char*) alloc_local(chunk_size);
+    buffers.mapped_bytes += chunk_size;
+    for (size_t offset = 0; offset + size <= chunk_size; offset += size) {
+        *(void**) (chunk + offset) = cache->free[c];
+        cache->free[c] = chunk + offset;
+        cache->free_count[c]++;
+    }
+}
+
+// a buffer of at least size bytes from the calling thread's lists, sizes too big for every
+// class come from malloc
+void* pool_alloc(size_t size) {
+    int c = buffer_class_of(size);
+    if (c < 0) {
+        return malloc(size);
+    }
+    
+    struct buffer_cache* cache = get_thread_buffers();
+    if (cache->free[c] == NULL) {
+        refill_buffers(cache, c);
+    }
+    void* block = cache->free[c];
+    cache->free[c] = *(void**) block;
+    cache->free_count[c]--;
+    cache->allocs[c].store(cache->allocs[c].load(memory_order_relaxed) + 1, memory_order_relaxed);
+    return block;
+}
+
+// gives a buffer from pool_alloc back to the calling thread's lists, size is the size it
+// was allocated with
+void pool_free(void* block, size_t size) {
+    int c = buffer_class_of(size);
+    if (c < 0) {
+        free(block);
+        return;
+    }
+    
+    struct buffer_cache* cache = get_thread_buffers();
+    *(void**) block = cache->free[c];
+    cache->free[c] = block;
+    cache->free_count[c]++;
+    if (cache->free_count[c] > 2 * buffer_batch(c)) {
+        spill_buffers(cache, c, buffer_batch(c));
+    }
+}
+
+// gives a thread's cached blocks to the shared lists and its cache to the next new thread,
+// called by threads that allocate from the pool before they exit
+void release_thread_buffers() {
+    struct buffer_cache* cache = thread_buffers;
+    if (cache == NULL) {
+        return;
+    }
+    
+    for (int c = 0; c < NUM_BUFFER_CLASSES; c++) {
+        if (cache->free_count[c] > 0) {
+            spill_buffers(cache, c, cache->free_count[c]);
+        }
+    }
+    pthread_mutex_lock(&buffers.caches_mutex);
+    cache->in_use = false;
+    pthread_mutex_unlock(&buffers.caches_mutex);
+    thread_buffers = NULL;
+}
+
+// a handler's coroutine, it starts when it is first awaited and its awaiter carries on
+// once it returns
+template <typename T>
+struct task {
+    struct promise_type {
+        T value;
+        coroutine_handle<> awaiter;
+        
+        task get_return_object() {
+            return task(coroutine_handle<promise_type>::from_promise(*this));
+        }
+        suspend_always initial_suspend() noexcept {
+            return suspend_always();
+        }
+        // switches straight to the awaiter, so a chain of coroutines finishing one after
+        // another doesn't pile up on the stack
+        struct final_awaiter {
+            bool await_ready() noexcept {
+                return false;
+            }
+            coroutine_handle<> await_suspend(coroutine_handle<promise_type> self) noexcept {
+                coroutine_handle<> awaiter = self.promise().awaiter;
+                return awaiter ? awaiter : noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept {
+            return final_awaiter();
+        }
+        void return_value(T result) {
+            value = result;
+        }
+        void unhandled_exception() {
+            abort();
+        }
+        // frames come and go with every request, and with every recv or send that parks
+        static void* operator new(size_t size) {
+            return pool_alloc(size);
+        }
+        static void operator delete(void* frame, size_t size) {
+            pool_free(frame, size);
+        }
+    };
+    
+    coroutine_handle<promise_type> handle;
+    
+    explicit task(coroutine_handle<promise_type> h) : handle(h) {}
+    task(task&& other) : handle(other.handle) {
+        other.handle = nullptr;
+    }
+    ~task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+    
+    bool await_ready() {
+        return false;
+    }
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiter) {
+        handle.promise().awaiter = awaiter;
+        return handle;
+    }
+    T await_resume() {
+        return handle.promise().value;
+    }
+};
+
+// a coroutine nothing awaits, it runs until it first parks and frees itself when it returns
+struct detached {
+    struct promise_type {
+        detached get_return_object() {
+            return detached();
+        }
+        suspend_never initial_suspend() noexcept {
+            return suspend_never();
+        }
+        suspend_never final_suspend() noexcept {
+            return suspend_never();
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            abort();
+        }
+        static void* operator new(size_t size) {
+            return pool_alloc(size);
+        }
+        static void operator delete(void* frame, size_t size) {
+            pool_free(frame, size);
+        }
+    };
+};
+
+// where a handler's I/O goes: a client connection, which the coroutine is parked on while
+// the socket isn't ready so the worker can serve other connections, or with conn NULL a
+// socket the calling thread blocks on, where the coroutine never parks
+struct io_context {
+    int fd;
+    struct connection* conn;
+    struct shared_data* shared;
+    // body bytes moved since the request last gave way to the ones waiting for a worker
+    long slice_bytes = 0;
+    // header of the request being served, NULL for requests served on a socketpair
+    const struct header* head = NULL;
+    // set while a chunked request body is read, with the bytes left in the chunk being read
+    // and whether the last chunk has been
+    bool chunked = false;
+    long chunk_left = 0;
+    bool body_done = false;
 };
 
+// runs a coroutine handler on a blocking socket to the end
+template <typename T>
+T run_blocking(task<T> t) {
+    t.handle.resume();
+    if (!t.handle.done()) {
+        errx(1, "handler parked on a blocking socket");
+    }
+    return t.handle.promise().value;
+}
+
+// parses the value of a Range header into head->ranges, a value that isn't a list of byte
+// ranges is left out, as the header may then be ignored
+void parse_ranges(const char* value, struct header* head) {
+    head->num_ranges = 0;
+    while (*value == ' ') {
+        value++;
+    }
+    if (strncmp(value, "bytes=", 6) != 0) {
+        return;
+    }
+    
+    char* p = (char*) value + 6;
+    int num_ranges = 0;
+    while (1) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        struct byte_range range = {-1, -1};
+        if (isdigit(*p)) {
+            range.first = strtol(p, &p, 10);
+        }
+        if (*p != '-') {
+            return;
+        }
+        p++;
+        if (isdigit(*p)) {
+            range.last = strtol(p, &p, 10);
+        }
+        if ((range.first < 0 && range.last < 0) || (range.last >= 0 && range.first > range.last) ||
+            num_ranges == MAX_RANGES) {
+            return;
+        }
+        head->ranges[num_ranges++] = range;
+        
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p != ',') {
+            break;
+        }
+        p++;
+    }
+    if (*p == '\r' || *p == '\0') {
+        head->num_ranges = num_ranges;
+    }
+}
+
+// copies the value of header name in buf into value, it's left empty if the header isn't
+// there or doesn't fit
+void header_value(const char* buf, const char* name, char value[], size_t size) {
+    value[0] = '\0';
+    char field[50];
+    snprintf(field, sizeof(field), "\r\n%s:", name);
+    const char* p = strstr(buf, field);
+    if (p == NULL) {
+        return;
+    }
+    p += strlen(field);
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    size_t length = strcspn(p, "\r");
+    while (length > 0 && (p[length-1] == ' ' || p[length-1] == '\t')) {
+        length--;
+    }
+    if (length < size) {
+        memcpy(value, p, length);
+        value[length] = '\0';
+    }
+}
+
 struct header parseHeader(char buf[]) {
     struct header head;
+    head.from_peer = strstr(buf, "\r\n" PEER_HEADER) != NULL;
+    head.handoff = strstr(buf, "\r\n" HANDOFF_HEADER) != NULL;
+    
+    // read before strtok splits the header up
+    char* range = strstr(buf, "\r\nRange:");
+    head.num_ranges = 0;
+    if (range != NULL) {
+        parse_ranges(range + strlen("\r\nRange:"), &head);
+    }
+    header_value(buf, "If-None-Match", head.if_none_match, CONDITION_SIZE);
+    header_value(buf, "If-Modified-Since", head.if_modified_since, CONDITION_SIZE);
+    header_value(buf, "If-Range", head.if_range, CONDITION_SIZE);
+    char encoding[CONDITION_SIZE];
+    header_value(buf, "Transfer-Encoding", encoding, CONDITION_SIZE);
+    head.chunked = strcasecmp(encoding, "chunked") == 0;
+    head.unknown_encoding = encoding[0] != '\0' && !head.chunked;
     
     char* token = strtok(buf, " ");
     head.command = token;
     
-    token = strtok(NULL, " ");
-    head.resource_name = token;
+    token = strtok(NULL, " ");
+    head.resource_name = token;
+    
+    head.content_length = -1;
+    
+    while ((token = strtok(NULL, " ")) != NULL) {
+        if (strstr(token, "\r\n\r\n") != NULL) {
+            // marks end of header
+            break;
+        }
+        
+        if (strstr(token, "Content-Length") != NULL) {
+            token = strtok(NULL, " ");
+            char *p = token;
+            long len = -1;
+            while (isdigit(*p) && *p != '\\') {
+                len = strtol(p, &p, 10);
+            }
+            head.content_length = len;
+        }
+    }
+    
+    return head;
+}
+
+// moves a connection into a phase and restarts its timeout, only touches the connection
+// so it costs nothing per request, the reaper finds the new deadline when the old one is due
+void set_phase(struct connection* conn, int phase) {
+    if (conn == NULL) {
+        return;
+    }
+    uint64_t timeout = conn->wheel->timeouts[phase];
+    conn->phase = phase;
+    conn->deadline = timeout == 0 ? UINT64_MAX : conn->wheel->now + timeout;
+}
+
+// receives exactly one request header into buf, leaving any of the body that came
+// with it in the socket for the handler, returns the header length or <= 0 on EOF/error,
+// conn is the client connection whose timeouts apply, NULL for peer responses
+int recv_header(int comm_fd, char buf[], struct connection* conn) {
+    int length = 0;
+    while (length < BUFFER_SIZE - 1) {
+        // peeks first so only the bytes up to the end of the header get taken
+        int n = recv(comm_fd, buf + length, BUFFER_SIZE - 1 - length, MSG_PEEK);
+        if (n <= 0) {
+            return n;
+        }
+        // the idle timeout ends and the header timeout starts with the first byte
+        if (length == 0) {
+            set_phase(conn, PHASE_HEADER);
+        }
+        buf[length + n] = '\0';
+        
+        // the terminator may straddle what was already taken and what was peeked
+        int search_from = length >= 3 ? length - 3 : 0;
+        char* end = strstr(buf + search_from, "\r\n\r\n");
+        int take = end != NULL ? end + 4 - (buf + length) : n;
+        if (recv(comm_fd, buf + length, take, 0) != take) {
+            return -1;
+        }
+        length += take;
+        
+        if (end != NULL) {
+            break;
+        }
+    }
+    buf[length] = '\0';
+    
+    return length;
+}
+
+// how much of a body to ask recv for with a buffer of buffer_size, so a body with a
+// Content-Length is never read past its end into the next request on the connection
+int body_chunk(long content_length, long content_size, int buffer_size) {
+    return content_length < 0 || content_size > buffer_size ? buffer_size : content_size;
+}
+
+// size of the buffer a body of length bytes (-1 if it isn't known) is moved through, it
+// grows with the object so a large one takes fewer syscalls without a small one tying up
+// a big buffer
+int transfer_buffer_size(long length) {
+    int size = BUFFER_SIZE;
+    while (size < MAX_CHUNK_SIZE && (length < 0 || length > (long) size * 16)) {
+        size *= 2;
+    }
+    return size;
+}
+
+// microseconds on the monotonic clock, which is read without a syscall
+uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// defined with the scheduler below, serves the small requests waiting between two slices
+void serve_waiting(struct worker_data* self);
+
+// counts body bytes a handler has moved, so a bulk request can give way to small requests
+// waiting behind it once every SLICE_BYTES
+void transfer_slice(long bytes) {
+    struct worker_data* self = current_worker;
+    if (self == NULL || !self->slicing) {
+        return;
+    }
+    self->slice_bytes += bytes;
+    if (self->slice_bytes >= SLICE_BYTES) {
+        self->slice_bytes = 0;
+        if (self->shared->ready_count > 0) {
+            serve_waiting(self);
+        }
+    }
+}
+
+// writes the response line and headers send_response sends into response, returns their length
+int format_response(char response[], int response_num, long content_len, char* resource_name) {
+    int k = 0;
+    
+    if (response_num == 400) {
+        k = snprintf(response, 200, "HTTP/1.1 400 Bad Request\r\nContent-Length: %ld\r\n\r\n", content_len);
+        
+    } else if (response_num == 403) {
+        k = snprintf(response, 200, "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n");
+        warn("404 File %s Forbidden Access\n", resource_name);
+        
+    } else if (response_num == 404) {
+        k = snprintf(response, 200, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        warn("404 File %s Not Found\n", resource_name);
+        
+    } else if (response_num == 500) {
+        k = snprintf(response, 200, "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+        warn("500 Internal Server Error While Opening %s\n", resource_name);
+        
+    } else if (response_num == 200) {
+        k = snprintf(response, 200, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n", content_len);
+        
+    } else if (response_num == 201) {
+        k = snprintf(response, 200, "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n");
+        
+    } else if (response_num == 501) {
+        k = snprintf(response, 200, "HTTP/1.1 501 Not Implemented\r\nContent-Length: 0\r\n\r\n");
+        warn("501 Request for %s Not Implemented\n", resource_name);
+    }
+    
+    return k;
+}
+
+int send_response(int comm_fd, int response_num, long content_len, char* resource_name) {
+    char response[200];
+    int k = format_response(response, response_num, content_len, resource_name);
+    send(comm_fd, response, k, 0);
+    
+    return 0;
+}
+
+// defined with the scheduler below, hands a connection to the workers
+void enqueue_ready(struct shared_data* shared, struct connection* conn);
+
+// parks the coroutine serving a connection until its socket is ready for events, the
+// dispatcher then hands the connection back to the workers and whichever takes it resumes
+// the coroutine; false if the socket can't be watched
+struct socket_wait {
+    struct io_context* io;
+    uint32_t events;
+    bool failed;
+    
+    bool await_ready() {
+        return false;
+    }
+    bool await_suspend(coroutine_handle<> self) {
+        struct connection* conn = io->conn;
+        conn->resume = self;
+        struct epoll_event event;
+        event.events = events | EPOLLONESHOT;
+        event.data.ptr = conn;
+        // once it is armed the coroutine may be resumed on another worker right away, so
+        // nothing in the frame is touched after
+        if (epoll_ctl(io->shared->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+            conn->resume = nullptr;
+            failed = true;
+            return false;
+        }
+        return true;
+    }
+    bool await_resume() {
+        return !failed;
+    }
+};
+
+// recv from the client, parking the coroutine while nothing has arrived
+task<ssize_t> async_recv(struct io_context* io, char buf[], size_t len, int flags = 0) {
+    while (1) {
+        ssize_t n = recv(io->fd, buf, len, flags | (io->conn != NULL ? MSG_DONTWAIT : 0));
+        if (n >= 0 || io->conn == NULL || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            co_return n;
+        }
+        if (!co_await socket_wait{io, EPOLLIN, false}) {
+            co_return -1;
+        }
+    }
+}
+
+// sends all len bytes of data to the client, parking the coroutine while the send buffer
+// is full, -1 if the client is gone
+task<ssize_t> async_send(struct io_context* io, const char* data, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(io->fd, data + sent, len - sent, MSG_NOSIGNAL | (io->conn != NULL ? MSG_DONTWAIT : 0));
+        if (n < 0 && io->conn != NULL && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!co_await socket_wait{io, EPOLLOUT, false}) {
+                co_return -1;
+            }
+            continue;
+        }
+        if (n < 0) {
+            co_return -1;
+        }
+        sent += n;
+    }
+    co_return sent;
+}
+
+// send_response to the client, parking the coroutine while the send buffer is full
+task<ssize_t> async_send_response(struct io_context* io, int response_num, long content_len, char* resource_name) {
+    char response[200];
+    int k = format_response(response, response_num, content_len, resource_name);
+    co_return co_await async_send(io, response, k);
+}
+
+// a read or write of a file, done on the spot: epoll always reports regular files ready,
+// so there is nothing to park on
+struct file_io {
+    ssize_t result;
+    
+    bool await_ready() {
+        return true;
+    }
+    void await_suspend(coroutine_handle<>) {}
+    ssize_t await_resume() {
+        return result;
+    }
+};
+
+file_io async_read(int fd, void* buf, size_t len) {
+    return file_io{read(fd, buf, len)};
+}
+
+// direct is set when fd was opened with O_DIRECT, which only takes whole blocks, so the
+// tail of a body is written through the page cache
+file_io async_write(int fd, const void* buf, size_t len, bool direct) {
+    size_t aligned = direct ? len / DIRECT_ALIGN * DIRECT_ALIGN : len;
+    ssize_t written = aligned > 0 ? write(fd, buf, aligned) : 0;
+    if (written < 0 || (size_t) written < aligned || aligned == len) {
+        return file_io{written};
+    }
+    
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    ssize_t rest = write(fd, (const char*) buf + aligned, len - aligned);
+    return file_io{rest < 0 ? -1 : written + rest};
+}
+
+// receives one line of a chunked body into line without its CRLF, the line is looked at
+// before it's taken so nothing after it is read, -1 if it doesn't fit or the client is gone
+task<int> recv_line(struct io_context* io, char line[], int size) {
+    int length = 0;
+    while (length == 0 || line[length-1] != '\n') {
+        if (length == size) {
+            co_return -1;
+        }
+        ssize_t n = co_await async_recv(io, line + length, size - length, MSG_PEEK);
+        if (n <= 0) {
+            co_return -1;
+        }
+        // the bytes are waiting, so taking them doesn't block
+        char* newline = (char*) memchr(line + length, '\n', n);
+        ssize_t take = newline != NULL ? newline - (line + length) + 1 : n;
+        if (recv(io->fd, line + length, take, 0) != take) {
+            co_return -1;
+        }
+        length += take;
+    }
+    length--;
+    if (length > 0 && line[length-1] == '\r') {
+        length--;
+    }
+    line[length] = '\0';
+    co_return length;
+}
+
+// answers a chunked body that isn't framed right with a 400, the handler reading it gives
+// up and the connection is closed
+task<ssize_t> bad_chunk(struct io_context* io) {
+    co_await async_send_response(io, 400, 0, NULL);
+    co_return -1;
+}
+
+// recv from the request body: for a chunked one that's the data of its chunks, and 0 once
+// the last chunk and any trailer after it have been read; otherwise the body runs to EOF
+// or its Content-Length, which the handler keeps track of
+task<ssize_t> async_recv_body(struct io_context* io, char buf[], size_t len) {
+    if (!io->chunked) {
+        co_return co_await async_recv(io, buf, len);
+    }
+    if (io->body_done) {
+        co_return 0;
+    }
+    
+    char line[CHUNK_LINE_SIZE];
+    if (io->chunk_left == 0) {
+        // chunk size in hex, chunk extensions after it are ignored
+        if (co_await recv_line(io, line, CHUNK_LINE_SIZE) < 0) {
+            co_return -1;
+        }
+        char* end;
+        errno = 0;
+        long size = strtol(line, &end, 16);
+        if (!isxdigit(line[0]) || errno == ERANGE || (*end != '\0' && *end != ';' && *end != ' ' && *end != '\t')) {
+            co_return co_await bad_chunk(io);
+        }
+        if (size == 0) {
+            // the trailer ends with a blank line
+            int length;
+            while ((length = co_await recv_line(io, line, CHUNK_LINE_SIZE)) != 0) {
+                if (length < 0) {
+                    co_return -1;
+                }
+            }
+            io->body_done = true;
+            co_return 0;
+        }
+        io->chunk_left = size;
+    }
+    
+    ssize_t n = co_await async_recv(io, buf, min(len, (size_t) io->chunk_left));
+    if (n <= 0) {
+        co_return -1;
+    }
+    io->chunk_left -= n;
+    // the CRLF after the chunk's data
+    if (io->chunk_left == 0) {
+        int length = co_await recv_line(io, line, CHUNK_LINE_SIZE);
+        if (length != 0) {
+            co_return length < 0 ? -1 : co_await bad_chunk(io);
+        }
+    }
+    co_return n;
+}
+
+// fills len bytes of buf from the request body unless it ends first, so a body is
+// written in whole chunks; returns the bytes received, or -1 if the client is gone
+task<ssize_t> async_recv_all(struct io_context* io, char buf[], size_t len) {
+    size_t filled = 0;
+    while (filled < len) {
+        ssize_t n = co_await async_recv_body(io, buf + filled, len - filled);
+        if (n < 0) {
+            co_return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        filled += n;
+    }
+    co_return filled;
+}
+
+// counts body bytes a coroutine handler has moved, once every SLICE_BYTES the request
+// gives way to the ones waiting for a worker by going to the back of the deques
+struct slice_point {
+    struct io_context* io;
+    long bytes;
+    
+    bool await_ready() {
+        if (io->conn == NULL) {
+            return true;
+        }
+        io->slice_bytes += bytes;
+        if (io->slice_bytes < SLICE_BYTES) {
+            return true;
+        }
+        io->slice_bytes = 0;
+        return io->shared->ready_count == 0;
+    }
+    void await_suspend(coroutine_handle<> self) {
+        struct connection* conn = io->conn;
+        struct shared_data* shared = io->shared;
+        conn->resume = self;
+        conn->ready_at = shared->timers.now;
+        conn->ready_us = now_us();
+        enqueue_ready(shared, conn);
+    }
+    void await_resume() {}
+};
+
+// source: section recording
+unsigned long getaddr(char* name) {
+    unsigned long res;
+    struct addrinfo hints;
+    struct addrinfo* info;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    if (getaddrinfo(name, NULL, &hints, &info) || info == NULL) {
+        fprintf(stderr, "error finding %s\n", name);
+        exit(1);
+    }
+
+    res = ((struct sockaddr_in*)info->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(info);
+    return res;
+}
+
+// 32 bit FNV-1a hash, used as the digest of log records and to pick shard directories
+uint32_t fnv1a(uint32_t hash, const unsigned char* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// where get_replica_digest got a replica's digest from
+#define DIGEST_STORED 0
+#define DIGEST_COMPUTED 1
+// only the length is known, the replica has no xattr
+#define DIGEST_UNKNOWN 2
+
+// whether a digest read from a replica's xattr was stored for the data it holds now
+bool digest_matches(const struct replica_digest* digest, const struct stat* st) {
+    return digest->length == (uint64_t) st->st_size && digest->inode == (uint64_t) st->st_ino &&
+        digest->mtime_ns == (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// stores digest in the xattr of a replica whose data has all been written
+int write_replica_digest(int fd, const struct replica_digest* digest) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    struct replica_digest stamped = *digest;
+    stamped.inode = st.st_ino;
+    stamped.mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return fsetxattr(fd, DIGEST_XATTR, &stamped, sizeof(stamped), 0);
+}
+
+// reads the digest of a replica from its xattr, or works it out from the data when the
+// xattr doesn't match the file; a filesystem without xattrs, or a replica written before
+// digests were kept, would have its data hashed on every GET and never get a digest
+// stored, so only its length is filled in
+int get_replica_digest(int fd, unsigned char buffer[], struct replica_digest* digest) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    ssize_t size = fgetxattr(fd, DIGEST_XATTR, digest, sizeof(*digest));
+    if (size == sizeof(*digest) && digest_matches(digest, &st)) {
+        return DIGEST_STORED;
+    }
+    
+    memset(digest, 0, sizeof(*digest));
+    if (size < 0 && (errno == ENOTSUP || errno == ENODATA)) {
+        digest->length = st.st_size;
+        return DIGEST_UNKNOWN;
+    }
+    
+    digest->digest = 2166136261u;
+    ssize_t n;
+    while ((n = pread(fd, buffer, BUFFER_SIZE, digest->length)) > 0) {
+        digest->digest = fnv1a(digest->digest, buffer, n);
+        digest->length += n;
+    }
+    
+    return n < 0 ? -1 : DIGEST_COMPUTED;
+}
+
+// returns the mutex for a file, creating it the first time the file is used
+pthread_mutex_t* find_file_mutex(struct shared_data* shared, const string& file_name) {
+    pthread_mutex_lock(&shared->file_mutex_map_mutex);
+    bool is_new = !shared->file_mutex_map.count(file_name);
+    pthread_mutex_t* file_mutex = &shared->file_mutex_map[file_name];
+    if (is_new) {
+        pthread_mutex_init(file_mutex, NULL);
+    }
+    pthread_mutex_unlock(&shared->file_mutex_map_mutex);
+    
+    return file_mutex;
+}
+
+bool is_known_file(struct shared_data* shared, const string& file_name) {
+    pthread_mutex_lock(&shared->file_mutex_map_mutex);
+    bool known = shared->known_files.count(file_name);
+    pthread_mutex_unlock(&shared->file_mutex_map_mutex);
+    
+    return known;
+}
+
+void add_known_file(struct shared_data* shared, const string& file_name) {
+    pthread_mutex_lock(&shared->file_mutex_map_mutex);
+    shared->known_files.insert(file_name);
+    pthread_mutex_unlock(&shared->file_mutex_map_mutex);
+}
+
+// returns true if name is a 10 character alphanumeric object name
+bool is_valid_name(const char* name) {
+    if (strlen(name) != 10) {
+        return false;
+    }
+    
+    for (int i = 0; i < 10; i++) {
+        if (!isalnum(name[i])) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// key of copy number copy of an object in known_files and file_mutex_map
+string replica_key(int copy, const char* name) {
+    char key[40];
+    snprintf(key, sizeof(key), "copy%d/%s", copy, name);
+    return key;
+}
+
+// returns the root dir of copy number copy, or NULL for copy 0 when there is no redundancy
+const char* copy_root(struct shared_data* shared, int copy) {
+    return copy == 0 ? NULL : shared->replica_roots[copy-1].c_str();
+}
+
+// builds the path of an object under root (NULL for the server dir) into path
+// flat layout: [name] or [root]/[name]
+// sharded layout: objects/ab/cd/[name] or [root]/ab/cd/[name], where ab and cd come from a hash of the name
+void object_path(char path[], const char* root, const char* name, bool sharded) {
+    char prefix[MAX_ROOT_LENGTH + 2];
+    if (root == NULL) {
+        snprintf(prefix, sizeof(prefix), "%s", sharded ? SHARD_DIR "/" : "");
+    } else {
+        snprintf(prefix, sizeof(prefix), "%s/", root);
+    }
+    
+    if (!sharded) {
+        snprintf(path, PATH_SIZE, "%s%s", prefix, name);
+        return;
+    }
+    
+    uint32_t hash = fnv1a(2166136261u, (const unsigned char*) name, strlen(name));
+    snprintf(path, PATH_SIZE, "%s%02x/%02x/%s", prefix, hash & 0xff, (hash >> 8) & 0xff, name);
+}
+
+// creates the directories leading up to path
+void make_parent_dirs(const char* path) {
+    char dir[PATH_SIZE];
+    strncpy(dir, path, PATH_SIZE);
+    dir[PATH_SIZE-1] = '\0';
+    
+    for (char* p = strchr(dir, '/'); p != NULL; p = strchr(p+1, '/')) {
+        *p = '\0';
+        mkdir(dir, 0777);
+        *p = '/';
+    }
+}
+
+// opens copy number copy of an object and leaves the path that was used in path
+// in the sharded layout, missing shard dirs are created for writes, and reads fall
+// back to the flat layout while files are still being migrated
+int open_object(struct shared_data* shared, char path[], int copy, const char* name, int flags) {
+    object_path(path, copy_root(shared, copy), name, shared->sharded);
+    int open_fd = open(path, flags, 0667);
+    
+    if (open_fd < 0 && errno == ENOENT && shared->sharded) {
+        if (flags & O_CREAT) {
+            make_parent_dirs(path);
+            open_fd = open(path, flags, 0667);
+        } else if (shared->migrating) {
+            object_path(path, copy_root(shared, copy), name, false);
+            open_fd = open(path, flags, 0667);
+        }
+    }
+    
+    return open_fd;
+}
+
+// same as open_object, but only stats the object without opening it, returns 0 if it's there
+// and readable
+int stat_object(struct shared_data* shared, char path[], int copy, const char* name, struct stat* st) {
+    object_path(path, copy_root(shared, copy), name, shared->sharded);
+    int status = stat(path, st);
+    
+    if (status < 0 && errno == ENOENT && shared->sharded && shared->migrating) {
+        object_path(path, copy_root(shared, copy), name, false);
+        status = stat(path, st);
+    }
+    if (status == 0 && !S_ISREG(st->st_mode)) {
+        errno = EIO;
+        return -1;
+    }
+    
+    return status < 0 ? -1 : access(path, R_OK);
+}
+
+// removes the flat copy of an object that was just written in the sharded layout,
+// so the migration thread can't move it over the newer data
+void remove_flat_copy(struct shared_data* shared, int copy, const char* name) {
+    if (shared->sharded && shared->migrating) {
+        char path[PATH_SIZE];
+        object_path(path, copy_root(shared, copy), name, false);
+        unlink(path);
+    }
+}
+// opens a temporary file next to copy number copy of an object, which replaces the object
+// when it is renamed over it; temporary names start with '.' so the startup scan skips them
+int open_temp_object(struct shared_data* shared, char temp_path[], int copy, const char* name, int flags) {
+    char path[PATH_SIZE];
+    object_path(path, copy_root(shared, copy), name, shared->sharded);
+    
+    // an object the server isn't allowed to write can't be replaced either
+    if (access(path, W_OK) < 0 && errno == EACCES) {
+        return -1;
+    }
+    
+    const char* slash = strrchr(path, '/');
+    int dir_length = slash == NULL ? 0 : slash - path + 1;
+    snprintf(temp_path, PATH_SIZE, "%.*s.%s.%lu", dir_length, path, name, shared->next_temp++);
+    int open_fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | flags, 0667);
+    if (open_fd < 0 && errno == ENOENT && shared->sharded) {
+        make_parent_dirs(temp_path);
+        open_fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | flags, 0667);
+    }
+    // a filesystem without O_DIRECT gets the file written through the page cache
+    if (open_fd < 0 && errno == EINVAL && (flags & O_DIRECT)) {
+        open_fd = open_temp_object(shared, temp_path, copy, name, flags & ~O_DIRECT);
+    }
+    
+    return open_fd;
+}
+
+// flags a PUT body of content_length bytes is written with, O_DIRECT for ones of at least
+// -D bytes so a huge upload doesn't push the objects being read out of the page cache
+int put_flags(struct shared_data* shared, long content_length) {
+    return shared->direct_put_size > 0 && content_length >= shared->direct_put_size ? O_DIRECT : 0;
+}
+
+bool is_direct(int fd) {
+    return (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+}
+
+// puts a temporary file from open_temp_object in place of the object, with the object's
+// file lock held; anything that opened the old object keeps reading the old data
+int rename_temp_object(struct shared_data* shared, const char* temp_path, int copy, const char* name) {
+    char path[PATH_SIZE];
+    object_path(path, copy_root(shared, copy), name, shared->sharded);
+    if (rename(temp_path, path) < 0) {
+        return -1;
+    }
+    remove_flat_copy(shared, copy, name);
+    
+    return 0;
+}
+
+// the body is written to a temporary file that replaces the object once it is all in, so the
+// file lock is only held for the rename and never while the coroutine waits on the client
+task<int> handle_put(struct io_context* io, char buf[], char* resource_name, long content_length, struct shared_data* shared) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    // resource_name points into buf, which gets overwritten by the body
+    char name[12];
+    strncpy(name, resource_name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    // cast char* to std::string
+    // file name 
+    string file_name(name);
+
+    // opens a temporary file for writing
+    char temp_path[PATH_SIZE];
+    int open_fd = open_temp_object(shared, temp_path, 0, name, put_flags(shared, content_length));
+    if (open_fd < 0) {
+        co_await async_send_response(io, errno == EACCES ? 403 : 500, content_length, name);
+        co_return -1;
+    }
+    bool direct = is_direct(open_fd);
+    
+    // reads the body, content_length of it or until EOF if it's not given
+    int buffer_size = transfer_buffer_size(content_length);
+    char* body_buffer = (char*) pool_alloc(buffer_size);
+    long content_size = content_length;
+    while (content_length < 0 || content_size > 0) {
+        // read from client
+        int want = body_chunk(content_length, content_size, buffer_size);
+        ssize_t n = co_await async_recv_all(io, body_buffer, want);
+        if (n < 0 || (n < want && content_length >= 0)) {
+            close(open_fd);
+            unlink(temp_path);
+            pool_free(body_buffer, buffer_size);
+            co_return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        // subtract number read of bytes from content_size
+        content_size -= n;
+
+        // write to file
+        if (co_await async_write(open_fd, body_buffer, n, direct) != n) {
+            close(open_fd);
+            unlink(temp_path);
+            pool_free(body_buffer, buffer_size);
+            co_await async_send_response(io, 500, content_length, name);
+            co_return -1;
+        }
+        co_await slice_point{io, n};
+    }
+    close(open_fd);
+    pool_free(body_buffer, buffer_size);
+
+    // gets mutex(es) and locks file(s)
+    // if file hasnt been encountered before and isnt in the map, insert into map
+    pthread_mutex_t* file_mutex = find_file_mutex(shared, file_name);
+    pthread_mutex_lock(file_mutex);
+    int status = rename_temp_object(shared, temp_path, 0, name);
+    if (status == 0) {
+        add_known_file(shared, file_name);
+    }
+    // unlocks mutex(es) for the file(s)
+    pthread_mutex_unlock(file_mutex);
+    
+    if (status < 0) {
+        unlink(temp_path);
+        co_await async_send_response(io, 500, content_length, name);
+        co_return -1;
+    }
+    
+    // send 201 response
+    co_await async_send_response(io, 201, content_length, name);
+    
+    co_return 0;
+}
+
+task<int> handle_put_redundancy(struct io_context* io, char buf[], char* resource_name, long content_length, struct shared_data* shared) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    // resource_name points into buf, which gets overwritten by the body
+    char name[12];
+    strncpy(name, resource_name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    int num_replicas = shared->replica_roots.size();
+    
+    // every replica is written to a temporary file, the ones that get the whole body
+    // replace the old replicas together at the end
+    vector<int> open_fds(num_replicas);
+    vector<bool> direct(num_replicas);
+    vector<string> temp_paths(num_replicas);
+    int num_open = 0;
+    int open_errno = 0;
+    for (int i = 0; i < num_replicas; i++) {
+        char temp_path[PATH_SIZE];
+        open_fds[i] = open_temp_object(shared, temp_path, i+1, name, put_flags(shared, content_length));
+        if (open_fds[i] < 0) {
+            open_errno = errno;
+            continue;
+        }
+        direct[i] = is_direct(open_fds[i]);
+        temp_paths[i] = temp_path;
+        num_open++;
+    }
+    
+    int status = 0;
+    if (num_open < shared->write_quorum) {
+        status = open_errno == EACCES ? 403 : 500;
+    }
+    
+    // reads the body, content_length of it or until EOF if it's not given, and writes
+    // it to every replica that is still good
+    struct replica_digest digest;
+    memset(&digest, 0, sizeof(digest));
+    digest.digest = 2166136261u;
+    int buffer_size = transfer_buffer_size(content_length);
+    char* body_buffer = (char*) pool_alloc(buffer_size);
+    long content_size = content_length;
+    while (status == 0 && (content_length < 0 || content_size > 0)) {
+        int want = body_chunk(content_length, content_size, buffer_size);
+        ssize_t n = co_await async_recv_all(io, body_buffer, want);
+        if (n < 0 || (n < want && content_length >= 0)) {
+            status = -1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        content_size -= n;
+        digest.digest = fnv1a(digest.digest, (unsigned char*) body_buffer, n);
+        digest.length += n;
+        
+        for (int i = 0; i < num_replicas; i++) {
+            if (open_fds[i] >= 0 && co_await async_write(open_fds[i], body_buffer, n, direct[i]) != n) {
+                close(open_fds[i]);
+                unlink(temp_paths[i].c_str());
+                open_fds[i] = -1;
+                num_open--;
+            }
+        }
+        if (num_open < shared->write_quorum) {
+            status = 500;
+        }
+        co_await slice_point{io, n};
+    }
+    pool_free(body_buffer, buffer_size);
+    
+    // marks the replicas that got the whole body as complete, a filesystem without
+    // xattrs leaves the digest to be worked out on GET
+    for (int i = 0; i < num_replicas; i++) {
+        if (open_fds[i] < 0) {
+            continue;
+        }
+        bool complete = status == 0 &&
+            (write_replica_digest(open_fds[i], &digest) == 0 || errno == ENOTSUP);
+        close(open_fds[i]);
+        if (!complete) {
+            unlink(temp_paths[i].c_str());
+            open_fds[i] = -1;
+            num_open--;
+        }
+    }
+    if (status == 0 && num_open < shared->write_quorum) {
+        status = 500;
+    }
+    
+    // locks every replica, always in the same order, and puts the new ones in place
+    if (status == 0) {
+        vector<pthread_mutex_t*> file_mutexes(num_replicas);
+        for (int i = 0; i < num_replicas; i++) {
+            string key = replica_key(i+1, name);
+            file_mutexes[i] = find_file_mutex(shared, key);
+            pthread_mutex_lock(file_mutexes[i]);
+            if (open_fds[i] < 0) {
+                continue;
+            }
+            if (rename_temp_object(shared, temp_paths[i].c_str(), i+1, name) < 0) {
+                unlink(temp_paths[i].c_str());
+                num_open--;
+            } else {
+                add_known_file(shared, key);
+            }
+        }
+        
+        // unlocks mutex(es) for the file(s)
+        for (int i = 0; i < num_replicas; i++) {
+            pthread_mutex_unlock(file_mutexes[i]);
+        }
+        if (num_open < shared->write_quorum) {
+            status = 500;
+        }
+    }
+    
+    if (status < 0) {
+        co_return -1;
+    } else if (status > 0) {
+        co_await async_send_response(io, status, content_length, name);
+        co_return -1;
+    }
+    
+    // send 201 response
+    co_await async_send_response(io, 201, content_length, name);
+    
+    co_return 0;
+}
+
+// sends count bytes of an open file from offset to the client with sendfile, so they never
+// pass through user space, the kernel is told the file is read in order and the chunk
+// after the one being sent is asked for so it is read from disk while the send waits on
+// the client; the socket is non-blocking while it's sent so a full send buffer parks the
+// request instead of the worker
+task<int> stream_file(struct io_context* io, int fd, off_t offset, long count) {
+    posix_fadvise(fd, offset, count, POSIX_FADV_SEQUENTIAL);
+    long chunk = transfer_buffer_size(count);
+    int flags = 0;
+    if (io->conn != NULL) {
+        flags = fcntl(io->fd, F_GETFL);
+        fcntl(io->fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    
+    int status = 0;
+    off_t end = offset + count;
+    while (offset < end) {
+        ssize_t n = sendfile(io->fd, fd, &offset, min(chunk, (long) (end - offset)));
+        if (n < 0 && io->conn != NULL && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!co_await socket_wait{io, EPOLLOUT, false}) {
+                status = -1;
+                break;
+            }
+            continue;
+        }
+        if (n <= 0) {
+            status = -1;
+            break;
+        }
+        posix_fadvise(fd, offset, chunk, POSIX_FADV_WILLNEED);
+        co_await slice_point{io, n};
+    }
+    
+    if (io->conn != NULL) {
+        fcntl(io->fd, F_SETFL, flags);
+    }
+    co_return status;
+}
+
+// what a response tells a client about the version of an object it describes
+struct object_version {
+    // quoted, as it's sent in the ETag header
+    char etag[64];
+    time_t mtime;
+};
+
+// the version of a plain object, its inode changes with every PUT since PUTs are renamed
+// over the object, and with the modification time and size it stands in for its data
+void stat_version(const struct stat* st, struct object_version* version) {
+    snprintf(version->etag, sizeof(version->etag), "\"%lx-%lx-%lx\"", (unsigned long) st->st_ino,
+        (unsigned long) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec, (unsigned long) st->st_size);
+    version->mtime = st->st_mtime;
+}
+
+// the version of a replicated object comes from the digest its replicas agree on
+void digest_version(const struct replica_digest* digest, time_t mtime, struct object_version* version) {
+    snprintf(version->etag, sizeof(version->etag), "\"%08x-%lx\"", digest->digest, (unsigned long) digest->length);
+    version->mtime = mtime;
+}
+
+// writes the ETag and Last-Modified headers of a version into headers, returns their length
+int format_version(char headers[], const struct object_version* version) {
+    struct tm tm;
+    gmtime_r(&version->mtime, &tm);
+    char date[40];
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return snprintf(headers, 150, "ETag: %s\r\nLast-Modified: %s\r\n", version->etag, date);
+}
+
+bool parse_http_date(const char* value, time_t* t) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        return false;
+    }
+    *t = timegm(&tm);
+    return true;
+}
+
+// true if etag is in a list of If-None-Match entity tags, which are compared without
+// their W/ prefix, or the list is "*"
+bool etag_matches(const char* list, const char* etag) {
+    if (strcmp(list, "*") == 0) {
+        return true;
+    }
+    size_t etag_length = strlen(etag);
+    const char* p = list;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == ',') {
+            p++;
+        }
+        if (strncmp(p, "W/", 2) == 0) {
+            p += 2;
+        }
+        size_t length = strcspn(p, ",");
+        while (length > 0 && p[length-1] == ' ') {
+            length--;
+        }
+        if (length == etag_length && strncmp(p, etag, length) == 0) {
+            return true;
+        }
+        p += strcspn(p, ",");
+    }
+    return false;
+}
+
+// true if the client already has this version, If-Modified-Since only counts when there's
+// no If-None-Match
+bool not_modified(const struct header* head, const struct object_version* version) {
+    if (head->if_none_match[0] != '\0') {
+        return etag_matches(head->if_none_match, version->etag);
+    }
+    time_t since;
+    return head->if_modified_since[0] != '\0' && parse_http_date(head->if_modified_since, &since) &&
+        version->mtime <= since;
+}
+
+// true if the ranges of a request are to be sent, an If-Range has to name this version by
+// its ETag or its exact modification time, otherwise the whole object is
+bool range_applies(const struct header* head, const struct object_version* version) {
+    if (head->if_range[0] == '\0') {
+        return true;
+    }
+    if (head->if_range[0] == '"') {
+        return strcmp(head->if_range, version->etag) == 0;
+    }
+    time_t since;
+    return parse_http_date(head->if_range, &since) && version->mtime == since;
+}
+
+// works the ranges of a request out against an object of size bytes into ranges, leaving
+// out the ones that start past its end, returns how many are left
+int resolve_ranges(const struct header* head, long size, struct byte_range ranges[]) {
+    int num_ranges = 0;
+    for (int i = 0; i < head->num_ranges; i++) {
+        struct byte_range range = head->ranges[i];
+        if (range.first < 0) {
+            // the last range.last bytes
+            if (range.last == 0 || size == 0) {
+                continue;
+            }
+            range.first = max(0L, size - range.last);
+            range.last = size - 1;
+        } else {
+            if (range.first >= size) {
+                continue;
+            }
+            if (range.last < 0 || range.last >= size) {
+                range.last = size - 1;
+            }
+        }
+        ranges[num_ranges++] = range;
+    }
+    
+    return num_ranges;
+}
+
+// writes the delimiter and headers that come before a part of a multipart/byteranges
+// response into part, returns their length
+int format_range_part(char part[], const struct byte_range* range, long size) {
+    return snprintf(part, 200, "\r\n--" RANGE_BOUNDARY "\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+        range->first, range->last, size);
+}
+
+// sends the response to a GET of an open object of size bytes: a 304 if the client has this
+// version already, all of it with a 200, or the ranges it asked for with a 206, as
+// multipart/byteranges if there's more than one, or a 416 if none of them are in the
+// object; a HEAD gets the headers of the 200 and fd isn't used
+task<int> send_object(struct io_context* io, int fd, long size, const struct object_version* version) {
+    const struct header* head = io->head;
+    bool is_head = head != NULL && strcmp(head->command, "HEAD") == 0;
+    char validators[150];
+    format_version(validators, version);
+    char response[400];
+    int k;
+    
+    if (head != NULL && not_modified(head, version)) {
+        k = snprintf(response, 400, "HTTP/1.1 304 Not Modified\r\n%s\r\n", validators);
+        co_return co_await async_send(io, response, k) < 0 ? -1 : 0;
+    }
+    
+    if (head == NULL || is_head || head->num_ranges == 0 || !range_applies(head, version)) {
+        // Tells client how many bytes to expect
+        k = snprintf(response, 400, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n%s\r\n", size, validators);
+        if (co_await async_send(io, response, k) < 0) {
+            co_return -1;
+        }
+        co_return is_head ? 0 : co_await stream_file(io, fd, 0, size);
+    }
+    
+    struct byte_range ranges[MAX_RANGES];
+    int num_ranges = resolve_ranges(head, size, ranges);
+    if (num_ranges == 0) {
+        k = snprintf(response, 400, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%ld\r\nContent-Length: 0\r\n\r\n", size);
+        co_return co_await async_send(io, response, k) < 0 ? -1 : 0;
+    }
+    
+    if (num_ranges == 1) {
+        k = snprintf(response, 400, "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %ld-%ld/%ld\r\nContent-Length: %ld\r\n%s\r\n",
+            ranges[0].first, ranges[0].last, size, ranges[0].last - ranges[0].first + 1, validators);
+        if (co_await async_send(io, response, k) < 0) {
+            co_return -1;
+        }
+        co_return co_await stream_file(io, fd, ranges[0].first, ranges[0].last - ranges[0].first + 1);
+    }
+    
+    // the length of the whole body is sent first, so the parts are measured before
+    char part[200];
+    const char* closing = "\r\n--" RANGE_BOUNDARY "--\r\n";
+    long content_len = strlen(closing);
+    for (int i = 0; i < num_ranges; i++) {
+        content_len += format_range_part(part, &ranges[i], size) + ranges[i].last - ranges[i].first + 1;
+    }
+    k = snprintf(response, 400, "HTTP/1.1 206 Partial Content\r\nContent-Type: multipart/byteranges; boundary=" RANGE_BOUNDARY "\r\nContent-Length: %ld\r\n%s\r\n",
+        content_len, validators);
+    if (co_await async_send(io, response, k) < 0) {
+        co_return -1;
+    }
+    for (int i = 0; i < num_ranges; i++) {
+        k = format_range_part(part, &ranges[i], size);
+        if (co_await async_send(io, part, k) < 0 ||
+            co_await stream_file(io, fd, ranges[i].first, ranges[i].last - ranges[i].first + 1) < 0) {
+            co_return -1;
+        }
+    }
+    co_return co_await async_send(io, closing, strlen(closing)) < 0 ? -1 : 0;
+}
+
+// the object is opened with its file lock held and streamed from the open file after, a PUT
+// meanwhile replaces the object without changing what this GET sends
+task<int> handle_get(struct io_context* io, char buf[], char* resource_name, long content_length, struct shared_data* shared) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    // cast char* to std::string
+    // file name 
+    string file_name(resource_name);
+    
+    // if file hasnt been encountered before, then invalid GET request
+    if (!is_known_file(shared, file_name)) {
+        co_await async_send_response(io, 404, content_length, resource_name);
+        co_return -1;
+    }
+    pthread_mutex_t* file_mutex = find_file_mutex(shared, file_name);
+    // locks mutex for a file
+    pthread_mutex_lock(file_mutex);
+    
+    char file_path[PATH_SIZE];
+    int open_fd = open_object(shared, file_path, 0, resource_name, O_RDONLY);
+    int open_errno = errno;
+    
+    // Gets Content-Length before sending a response
+    struct stat file_stat;
+    if (open_fd >= 0 && (fstat(open_fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))) {
+        close(open_fd);
+        open_fd = -1;
+        open_errno = EIO;
+    }
+    
+    // unlocks mutex(es) for the file(s)
+    pthread_mutex_unlock(file_mutex);
+        
+    // send appropriate response
+    if (open_fd < 0) {
+        // named file does not exist, send 404 response
+        if (open_errno == ENOENT) {
+            co_await async_send_response(io, 404, content_length, resource_name);
+        }
+        // named file cannot be opened due to permissions
+        else if (open_errno == EACCES) {
+            co_await async_send_response(io, 403, content_length, resource_name);
+        }
+        else {
+            // send 500 response
+            co_await async_send_response(io, 500, content_length, resource_name);
+        }
+        co_return -1;
+    }
+    
+    // Sends the data of size Content-Length, or the ranges asked for
+    struct object_version version;
+    stat_version(&file_stat, &version);
+    int status = co_await send_object(io, open_fd, file_stat.st_size, &version);
+    
+    close(open_fd);
+    
+    co_return status;
+}
+
+// answers a HEAD with the headers a GET would get, from the object's metadata
+task<int> handle_head(struct io_context* io, char buf[], char* resource_name, long content_length, struct shared_data* shared) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    string file_name(resource_name);
+    if (!is_known_file(shared, file_name)) {
+        co_await async_send_response(io, 404, content_length, resource_name);
+        co_return -1;
+    }
+    pthread_mutex_t* file_mutex = find_file_mutex(shared, file_name);
+    pthread_mutex_lock(file_mutex);
+    
+    char file_path[PATH_SIZE];
+    struct stat file_stat;
+    int found = stat_object(shared, file_path, 0, resource_name, &file_stat);
+    int stat_errno = errno;
+    
+    pthread_mutex_unlock(file_mutex);
+    
+    if (found < 0) {
+        co_await async_send_response(io, stat_errno == ENOENT ? 404 : stat_errno == EACCES ? 403 : 500,
+            content_length, resource_name);
+        co_return -1;
+    }
+    
+    struct object_version version;
+    stat_version(&file_stat, &version);
+    co_return co_await send_object(io, -1, file_stat.st_size, &version);
+}
+
+// opens every replica of an object for reading and gets its digest, and where it came from
+// in sources, replicas that can't be opened are left at -1 in open_fds and the last errno
+// is kept in open_errno
+int open_replicas(struct shared_data* shared, const char* name, unsigned char buffer[], vector<int>& open_fds,
+    vector<struct replica_digest>& digests, vector<int>& sources, int* open_errno) {
+    int num_replicas = shared->replica_roots.size();
+    open_fds.assign(num_replicas, -1);
+    digests.resize(num_replicas);
+    sources.assign(num_replicas, DIGEST_UNKNOWN);
+    
+    int num_open = 0;
+    for (int i = 0; i < num_replicas; i++) {
+        char path[PATH_SIZE];
+        open_fds[i] = open_object(shared, path, i+1, name, O_RDONLY);
+        int digest_status = open_fds[i] < 0 ? 0 : get_replica_digest(open_fds[i], buffer, &digests[i]);
+        if (digest_status < 0) {
+            close(open_fds[i]);
+            open_fds[i] = -1;
+            errno = EIO;
+        }
+        sources[i] = digest_status;
+        if (open_fds[i] < 0) {
+            *open_errno = errno;
+            continue;
+        }
+        num_open++;
+    }
+    
+    return num_open;
+}
+
+// replicas agree if their lengths and digests match, a replica whose digest isn't known
+// agrees with any other of the same length
+bool replicas_agree(int i, int j, const vector<struct replica_digest>& digests, const vector<int>& sources) {
+    return digests[i].length == digests[j].length &&
+        (sources[i] == DIGEST_UNKNOWN || sources[j] == DIGEST_UNKNOWN || digests[i].digest == digests[j].digest);
+}
+
+// picks the replica whose digest the most other replicas agree with, on a tie one whose
+// digest was stored by a complete PUT wins, returns -1 if no replica could be opened
+int choose_replica(const vector<int>& open_fds, const vector<struct replica_digest>& digests,
+    const vector<int>& sources, int* votes) {
+    int chosen = -1;
+    *votes = 0;
+    for (size_t i = 0; i < open_fds.size(); i++) {
+        if (open_fds[i] < 0) {
+            continue;
+        }
+        int agree = 0;
+        for (size_t j = 0; j < open_fds.size(); j++) {
+            if (open_fds[j] >= 0 && replicas_agree(i, j, digests, sources)) {
+                agree++;
+            }
+        }
+        if (agree > *votes || (agree == *votes && sources[i] == DIGEST_STORED && sources[chosen] != DIGEST_STORED)) {
+            chosen = i;
+            *votes = agree;
+        }
+    }
+    
+    return chosen;
+}
+
+// true if replica i is missing, differs from the chosen one, or has a stale digest stored;
+// one without a digest only differs if its length does, since storing one can't be retried
+bool is_divergent(int i, int chosen, const vector<int>& open_fds, const vector<struct replica_digest>& digests,
+    const vector<int>& sources) {
+    return open_fds[i] < 0 || sources[i] == DIGEST_COMPUTED || !replicas_agree(i, chosen, digests, sources);
+}
+
+// queues an object for the repair thread, unless it's already waiting
+void queue_repair(struct shared_data* shared, const char* name) {
+    pthread_mutex_lock(&shared->repair_mutex);
+    if (shared->repair_pending.insert(name).second) {
+        shared->repair_queue.push(name);
+        shared->divergences_detected++;
+        pthread_cond_signal(&shared->repair_cond);
+    }
+    pthread_mutex_unlock(&shared->repair_mutex);
+}
+
+task<int> handle_get_redundancy(struct io_context* io, char buf[], char* resource_name, long content_length, struct shared_data* shared) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    int num_replicas = shared->replica_roots.size();
+    
+    // if the object was never written, then invalid GET request
+    vector<string> keys(num_replicas);
+    bool known = false;
+    for (int i = 0; i < num_replicas; i++) {
+        keys[i] = replica_key(i+1, resource_name);
+        known = known || is_known_file(shared, keys[i]);
+    }
+    if (!known) {
+        co_await async_send_response(io, 404, content_length, resource_name);
+        co_return -1;
+    }
+    
+    vector<pthread_mutex_t*> file_mutexes(num_replicas);
+    for (int i = 0; i < num_replicas; i++) {
+        file_mutexes[i] = find_file_mutex(shared, keys[i]);
+        pthread_mutex_lock(file_mutexes[i]);
+    }
+    
+    unsigned char* get_buffer = (unsigned char*) pool_alloc(BUFFER_SIZE);
+    
+    // the digests are compared instead of the data
+    vector<int> open_fds;
+    vector<struct replica_digest> digests;
+    vector<int> sources;
+    int open_errno = 0;
+    int num_open = open_replicas(shared, resource_name, get_buffer, open_fds, digests, sources, &open_errno);
+    int votes;
+    int chosen = choose_replica(open_fds, digests, sources, &votes);
+    
+    bool divergent = false;
+    for (int i = 0; i < num_replicas; i++) {
+        if (open_fds[i] >= 0 && i != chosen) {
+            close(open_fds[i]);
+        }
+        divergent = divergent || (chosen >= 0 && is_divergent(i, chosen, open_fds, digests, sources));
+    }
+    
+    // the chosen replica is streamed from its open file once the locks are let go
+    for (int i = 0; i < num_replicas; i++) {
+        pthread_mutex_unlock(file_mutexes[i]);
+    }
+    pool_free(get_buffer, BUFFER_SIZE);
+    
+    // send appropriate response
+    if (votes < shared->read_quorum) {
+        if (chosen >= 0) {
+            close(open_fds[chosen]);
+        }
+        // named file does not exist, send 404 response
+        if (num_open < shared->read_quorum && open_errno == ENOENT) {
+            co_await async_send_response(io, 404, content_length, resource_name);
+        }
+        // named file cannot be opened due to permissions
+        else if (num_open < shared->read_quorum && open_errno == EACCES) {
+            co_await async_send_response(io, 403, content_length, resource_name);
+        }
+        else {
+            // send 500 response
+            co_await async_send_response(io, 500, content_length, resource_name);
+        }
+        co_return -1;
+    }
+    
+    // the replicas that lost the vote get rewritten in the background, so later
+    // GETs of this object find them all in agreement
+    if (divergent) {
+        queue_repair(shared, resource_name);
+    }
+    
+    // Sends the data of size Content-Length, or the ranges asked for
+    int open_fd = open_fds[chosen];
+    struct stat file_stat;
+    struct object_version version;
+    memset(&file_stat, 0, sizeof(file_stat));
+    fstat(open_fd, &file_stat);
+    if (sources[chosen] == DIGEST_UNKNOWN) {
+        stat_version(&file_stat, &version);
+    } else {
+        digest_version(&digests[chosen], file_stat.st_mtime, &version);
+    }
+    int status = co_await send_object(io, open_fd, digests[chosen].length, &version);
+
+    close(open_fd);
+    
+    co_return status;
+}
+
+// same as open_replicas, but the replicas are only looked at: a replica's stored digest is
+// read from its path, and only one without a stored digest is opened to work it out,
+// replicas that aren't there are left at -1 in found and the last errno is kept in open_errno
+int stat_replicas(struct shared_data* shared, const char* name, unsigned char buffer[], vector<int>& found,
+    vector<struct replica_digest>& digests, vector<int>& sources, vector<struct stat>& stats, int* open_errno) {
+    int num_replicas = shared->replica_roots.size();
+    found.assign(num_replicas, -1);
+    digests.resize(num_replicas);
+    sources.assign(num_replicas, DIGEST_UNKNOWN);
+    stats.resize(num_replicas);
+    
+    int num_found = 0;
+    for (int i = 0; i < num_replicas; i++) {
+        char path[PATH_SIZE];
+        if (stat_object(shared, path, i+1, name, &stats[i]) < 0) {
+            *open_errno = errno;
+            continue;
+        }
+        if (getxattr(path, DIGEST_XATTR, &digests[i], sizeof(digests[i])) == sizeof(digests[i]) &&
+            digest_matches(&digests[i], &stats[i])) {
+            sources[i] = DIGEST_STORED;
+        } else {
+            int fd = open(path, O_RDONLY);
+            int digest_status = fd < 0 ? -1 : get_replica_digest(fd, buffer, &digests[i]);
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (digest_status < 0) {
+                *open_errno = EIO;
+                continue;
+            }
+            sources[i] = digest_status;
+        }
+        found[i] = 0;
+        num_found++;
+    }
+    
+    return num_found;
+}
+
+// answers a HEAD with the headers a GET would get, from the replicas' metadata
+task<int> handle_head_redundancy(struct io_context* io, char buf[], char* resource_name, long content_length, struct shared_data* shared) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    int num_replicas = shared->replica_roots.size();
+    
+    vector<string> keys(num_replicas);
+    bool known = false;
+    for (int i = 0; i < num_replicas; i++) {
+        keys[i] = replica_key(i+1, resource_name);
+        known = known || is_known_file(shared, keys[i]);
+    }
+    if (!known) {
+        co_await async_send_response(io, 404, content_length, resource_name);
+        co_return -1;
+    }
+    
+    vector<pthread_mutex_t*> file_mutexes(num_replicas);
+    for (int i = 0; i < num_replicas; i++) {
+        file_mutexes[i] = find_file_mutex(shared, keys[i]);
+        pthread_mutex_lock(file_mutexes[i]);
+    }
+    
+    unsigned char* digest_buffer = (unsigned char*) pool_alloc(BUFFER_SIZE);
+    vector<int> found;
+    vector<struct replica_digest> digests;
+    vector<int> sources;
+    vector<struct stat> stats;
+    int open_errno = 0;
+    int num_found = stat_replicas(shared, resource_name, digest_buffer, found, digests, sources, stats, &open_errno);
+    int votes;
+    int chosen = choose_replica(found, digests, sources, &votes);
+    
+    for (int i = 0; i < num_replicas; i++) {
+        pthread_mutex_unlock(file_mutexes[i]);
+    }
+    pool_free(digest_buffer, BUFFER_SIZE);
+    
+    if (votes < shared->read_quorum) {
+        if (num_found < shared->read_quorum && open_errno == ENOENT) {
+            co_await async_send_response(io, 404, content_length, resource_name);
+        } else if (num_found < shared->read_quorum && open_errno == EACCES) {
+            co_await async_send_response(io, 403, content_length, resource_name);
+        } else {
+            co_await async_send_response(io, 500, content_length, resource_name);
+        }
+        co_return -1;
+    }
+    
+    struct object_version version;
+    if (sources[chosen] == DIGEST_UNKNOWN) {
+        stat_version(&stats[chosen], &version);
+    } else {
+        digest_version(&digests[chosen], stats[chosen].st_mtime, &version);
+    }
+    co_return co_await send_object(io, -1, digests[chosen].length, &version);
+}
+
+// rewrites the replicas of an object that don't match the winning one, under the same
+// locks a PUT takes
+void repair_object(struct shared_data* shared, const string& name, unsigned char buffer[]) {
+    int num_replicas = shared->replica_roots.size();
+    
+    vector<pthread_mutex_t*> file_mutexes(num_replicas);
+    for (int i = 0; i < num_replicas; i++) {
+        file_mutexes[i] = find_file_mutex(shared, replica_key(i+1, name.c_str()));
+        pthread_mutex_lock(file_mutexes[i]);
+    }
+    
+    // the replicas are looked at again, a PUT may have fixed them since the GET
+    vector<int> open_fds;
+    vector<struct replica_digest> digests;
+    vector<int> sources;
+    int open_errno = 0;
+    open_replicas(shared, name.c_str(), buffer, open_fds, digests, sources, &open_errno);
+    int votes;
+    int chosen = choose_replica(open_fds, digests, sources, &votes);
+    // a digest that was never worked out isn't stored on the replicas that are rewritten
+    bool store_digest = chosen >= 0 && sources[chosen] != DIGEST_UNKNOWN;
+    
+    // only a replica that a GET would serve is copied over the others
+    bool repaired = chosen >= 0 && votes >= shared->read_quorum;
+    for (int i = 0; repaired && i < num_replicas; i++) {
+        if (!is_divergent(i, chosen, open_fds, digests, sources)) {
+            continue;
+        }
+        
+        // a replica with the right data just needs its digest stored
+        if (open_fds[i] >= 0 && replicas_agree(i, chosen, digests, sources)) {
+            write_replica_digest(open_fds[i], &digests[i]);
+            continue;
+        }
+        
+        // the copy is renamed over the replica, GETs streaming the old one keep their data
+        char temp_path[PATH_SIZE];
+        int repair_fd = open_temp_object(shared, temp_path, i+1, name.c_str(), 0);
+        if (repair_fd < 0) {
+            repaired = false;
+            continue;
+        }
+        
+        off_t offset = 0;
+        while (offset < (off_t) digests[chosen].length) {
+            if (sendfile(repair_fd, open_fds[chosen], &offset, digests[chosen].length - offset) <= 0) {
+                break;
+            }
+        }
+        if (offset != (off_t) digests[chosen].length || (store_digest &&
+            write_replica_digest(repair_fd, &digests[chosen]) < 0 && errno != ENOTSUP) ||
+            rename_temp_object(shared, temp_path, i+1, name.c_str()) < 0) {
+            unlink(temp_path);
+            repaired = false;
+        } else {
+            add_known_file(shared, replica_key(i+1, name.c_str()));
+        }
+        close(repair_fd);
+    }
+    
+    if (repaired) {
+        shared->divergences_repaired++;
+    }
+    
+    for (int i = 0; i < num_replicas; i++) {
+        if (open_fds[i] >= 0) {
+            close(open_fds[i]);
+        }
+        pthread_mutex_unlock(file_mutexes[i]);
+    }
+}
+
+// works through the objects queued by GETs that found divergent replicas
+void* repairer(void* data) {
+    struct shared_data* shared = (struct shared_data*) data;
+    unsigned char* repair_buffer = (unsigned char*) malloc(BUFFER_SIZE * sizeof(unsigned char));
+    
+    while (1) {
+        pthread_mutex_lock(&shared->repair_mutex);
+        while (shared->repair_queue.empty()) {
+            pthread_cond_wait(&shared->repair_cond, &shared->repair_mutex);
+        }
+        string name = shared->repair_queue.front();
+        shared->repair_queue.pop();
+        pthread_mutex_unlock(&shared->repair_mutex);
+        
+        repair_object(shared, name, repair_buffer);
+        
+        pthread_mutex_lock(&shared->repair_mutex);
+        shared->repair_pending.erase(name);
+        pthread_mutex_unlock(&shared->repair_mutex);
+    }
+    
+    return NULL;
+}
+
+// xors len bytes of src into dst
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+void xor_block_avx2(unsigned char* dst, const unsigned char* src, size_t len) {
+    for (size_t i = 0; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (src + i));
+        _mm256_storeu_si256((__m256i*) (dst + i), _mm256_xor_si256(a, b));
+    }
+}
+#endif
+
+void xor_block(unsigned char* dst, const unsigned char* src, size_t len) {
+    size_t i = 0;
+#if defined(__x86_64__)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) {
+        i = len - len % 32;
+        xor_block_avx2(dst, src, i);
+    }
+    // SSE2 is always there on x86-64
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (src + i));
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_xor_si128(a, b));
+    }
+#endif
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+// writes one full stripe, the data units go to the data shards and their xor to the parity shard
+int write_stripe(int shard_fds[], unsigned char stripe[], uint32_t digests[]) {
+    unsigned char parity[EC_UNIT];
+    memcpy(parity, stripe, EC_UNIT);
+    for (int i = 1; i < EC_DATA_SHARDS; i++) {
+        xor_block(parity, stripe + i * EC_UNIT, EC_UNIT);
+    }
+    
+    for (int i = 0; i < EC_SHARDS; i++) {
+        unsigned char* unit = i < EC_DATA_SHARDS ? stripe + i * EC_UNIT : parity;
+        if (write(shard_fds[i], unit, EC_UNIT) != EC_UNIT) {
+            return -1;
+        }
+        digests[i] = fnv1a(digests[i], unit, EC_UNIT);
+    }
+    
+    return 0;
+}
+
+int handle_put_erasure(int comm_fd, char buf[], char* resource_name, long content_length, struct shared_data* shared) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    // resource_name points into buf, which gets overwritten by the body
+    char name[12];
+    strncpy(name, resource_name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    
+    // every shard is written to a temporary file and needed to write the object, the
+    // new shards replace the old ones together at the end, the header is filled in last
+    int shard_fds[EC_SHARDS];
+    char temp_paths[EC_SHARDS][PATH_SIZE];
+    int status = 0;
+    for (int i = 0; i < EC_SHARDS; i++) {
+        shard_fds[i] = open_temp_object(shared, temp_paths[i], i+1, name, 0);
+        if (shard_fds[i] < 0) {
+            status = errno == EACCES ? 403 : 500;
+        } else {
+            lseek(shard_fds[i], sizeof(struct ec_header), SEEK_SET);
+        }
+    }
+    
+    unsigned char stripe[EC_DATA_SHARDS * EC_UNIT];
+    size_t stripe_fill = 0;
+    uint32_t digests[EC_SHARDS];
+    for (int i = 0; i < EC_SHARDS; i++) {
+        digests[i] = 2166136261u;
+    }
+    uint64_t object_length = 0;
+    uint64_t shard_length = 0;
+    uint32_t write_id = 0;
+    if (getrandom(&write_id, sizeof(write_id), 0) != sizeof(write_id)) {
+        write_id = shared->next_temp++;
+    }
+    
+    // reads the body, content_length of it or until EOF if it's not given
+    long content_size = content_length;
+    while (status == 0 && (content_length < 0 || content_size > 0)) {
+        int n = recv(comm_fd, buf, body_chunk(content_length, content_size, BUFFER_SIZE), 0);
+        if (n <= 0) {
+            if (content_length < 0 && n == 0) {
+                break;
+            }
+            status = -1;
+            break;
+        }
+        content_size -= n;
+        object_length += n;
+        
+        // cuts the data up into stripes
+        for (int pos = 0; pos < n && status == 0;) {
+            size_t take = min((size_t) (n - pos), sizeof(stripe) - stripe_fill);
+            memcpy(stripe + stripe_fill, buf + pos, take);
+            stripe_fill += take;
+            pos += take;
+            
+            if (stripe_fill == sizeof(stripe)) {
+                status = write_stripe(shard_fds, stripe, digests) < 0 ? 500 : 0;
+                shard_length += EC_UNIT;
+                stripe_fill = 0;
+            }
+        }
+        transfer_slice(n);
+    }
+    
+    // last stripe is padded with zeros
+    if (status == 0 && stripe_fill > 0) {
+        memset(stripe + stripe_fill, 0, sizeof(stripe) - stripe_fill);
+        status = write_stripe(shard_fds, stripe, digests) < 0 ? 500 : 0;
+        shard_length += EC_UNIT;
+    }
+    
+    for (int i = 0; i < EC_SHARDS; i++) {
+        if (shard_fds[i] < 0) {
+            continue;
+        }
+        
+        if (status == 0) {
+            struct ec_header header;
+            memset(&header, 0, sizeof(header));
+            header.magic = EC_MAGIC;
+            header.index = i;
+            header.data_shards = EC_DATA_SHARDS;
+            header.parity_shards = EC_PARITY_SHARDS;
+            header.object_length = object_length;
+            header.shard_length = shard_length;
+            header.digest = digests[i];
+            header.write_id = write_id;
+            if (pwrite(shard_fds[i], &header, sizeof(header), 0) != sizeof(header)) {
+                status = 500;
+            }
+        }
+        close(shard_fds[i]);
+    }
+    
+    // locks the shard in every replica root, always in the same order, and puts the new
+    // shards in place
+    if (status == 0) {
+        pthread_mutex_t* file_mutexes[EC_SHARDS];
+        for (int i = 0; i < EC_SHARDS; i++) {
+            string key = replica_key(i+1, name);
+            file_mutexes[i] = find_file_mutex(shared, key);
+            pthread_mutex_lock(file_mutexes[i]);
+            if (status == 0 && rename_temp_object(shared, temp_paths[i], i+1, name) == 0) {
+                add_known_file(shared, key);
+                shard_fds[i] = -1;
+            } else {
+                status = 500;
+            }
+        }
+        
+        for (int i = 0; i < EC_SHARDS; i++) {
+            pthread_mutex_unlock(file_mutexes[i]);
+        }
+    }
+    
+    // shards that didn't make it into place
+    for (int i = 0; i < EC_SHARDS; i++) {
+        if (shard_fds[i] >= 0) {
+            unlink(temp_paths[i]);
+        }
+    }
+    
+    if (status < 0) {
+        return -1;
+    } else if (status > 0) {
+        send_response(comm_fd, status, content_length, name);
+        return -1;
+    }
+    
+    // send 201 response
+    send_response(comm_fd, 201, content_length, name);
+    return 0;
+}
+
+// checks a shard's header and digest, leaves the header in header
+bool check_shard(int fd, int index, struct ec_header* header) {
+    if (fd < 0 || pread(fd, header, sizeof(*header), 0) != sizeof(*header)) {
+        return false;
+    }
+    
+    if (header->magic != EC_MAGIC || header->index != index || header->data_shards != EC_DATA_SHARDS ||
+        header->parity_shards != EC_PARITY_SHARDS || header->shard_length % EC_UNIT != 0) {
+        return false;
+    }
+    
+    unsigned char check_buffer[BUFFER_SIZE];
+    uint32_t digest = 2166136261u;
+    uint64_t checked = 0;
+    while (checked < header->shard_length) {
+        ssize_t n = pread(fd, check_buffer, min((uint64_t) BUFFER_SIZE, header->shard_length - checked), sizeof(*header) + checked);
+        if (n <= 0) {
+            return false;
+        }
+        digest = fnv1a(digest, check_buffer, n);
+        checked += n;
+    }
+    
+    return digest == header->digest;
+}
+
+int handle_get_erasure(int comm_fd, char buf[], char* resource_name, long content_length, struct shared_data* shared) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    pthread_mutex_t* file_mutexes[EC_SHARDS];
+    for (int i = 0; i < EC_SHARDS; i++) {
+        string key = replica_key(i+1, resource_name);
+        if (!is_known_file(shared, key)) {
+            send_response(comm_fd, 404, content_length, resource_name);
+            return -1;
+        }
+        file_mutexes[i] = find_file_mutex(shared, key);
+    }
+    for (int i = 0; i < EC_SHARDS; i++) {
+        pthread_mutex_lock(file_mutexes[i]);
+    }
+    
+    int shard_fds[EC_SHARDS];
+    int open_errno = 0;
+    for (int i = 0; i < EC_SHARDS; i++) {
+        char path[PATH_SIZE];
+        shard_fds[i] = open_object(shared, path, i+1, resource_name, O_RDONLY);
+        if (shard_fds[i] < 0) {
+            open_errno = errno;
+        }
+    }
+    
+    // data shards are checked first, the parity shard is only needed if one of them is bad,
+    // and the object is rebuilt from EC_DATA_SHARDS healthy shards written by the same PUT
+    bool healthy[EC_SHARDS] = {false};
+    struct ec_header headers[EC_SHARDS];
+    struct ec_header good_header;
+    memset(&good_header, 0, sizeof(good_header));
+    int num_healthy = 0;
+    for (int i = 0; i < EC_SHARDS && num_healthy < EC_DATA_SHARDS; i++) {
+        healthy[i] = check_shard(shard_fds[i], i, &headers[i]);
+        if (!healthy[i]) {
+            continue;
+        }
+        
+        int agree = 0;
+        for (int j = 0; j <= i; j++) {
+            if (healthy[j] && headers[j].write_id == headers[i].write_id &&
+                headers[j].object_length == headers[i].object_length &&
+                headers[j].shard_length == headers[i].shard_length) {
+                agree++;
+            }
+        }
+        if (agree > num_healthy) {
+            good_header = headers[i];
+            num_healthy = agree;
+        }
+    }
+    
+    // with one parity shard at most one data shard can be rebuilt
+    int missing = -1;
+    for (int i = 0; num_healthy == EC_DATA_SHARDS && i < EC_DATA_SHARDS; i++) {
+        if (!healthy[i] || headers[i].write_id != good_header.write_id ||
+            headers[i].object_length != good_header.object_length ||
+            headers[i].shard_length != good_header.shard_length) {
+            missing = i;
+        }
+    }
+    
+    int status = 0;
+    if (num_healthy < EC_DATA_SHARDS) {
+        if (open_errno == ENOENT) {
+            status = 404;
+        } else if (open_errno == EACCES) {
+            status = 403;
+        } else {
+            status = 500;
+        }
+    } else {
+        // Tells client how many bytes to expect
+        send_response(comm_fd, 200, good_header.object_length, resource_name);
+        
+        // rebuilds each stripe from the healthy shards, a missing data unit is the
+        // xor of the parity unit and the other data units
+        unsigned char stripe[EC_DATA_SHARDS * EC_UNIT];
+        uint64_t left = good_header.object_length;
+        for (uint64_t offset = 0; left > 0 && status == 0; offset += EC_UNIT) {
+            off_t shard_offset = sizeof(struct ec_header) + offset;
+            for (int i = 0; i < EC_DATA_SHARDS; i++) {
+                if (i != missing && pread(shard_fds[i], stripe + i * EC_UNIT, EC_UNIT, shard_offset) != EC_UNIT) {
+                    status = -1;
+                }
+            }
+            
+            if (missing >= 0 && missing < EC_DATA_SHARDS && status == 0) {
+                unsigned char* unit = stripe + missing * EC_UNIT;
+                if (pread(shard_fds[EC_DATA_SHARDS], unit, EC_UNIT, shard_offset) != EC_UNIT) {
+                    status = -1;
+                }
+                for (int i = 0; i < EC_DATA_SHARDS; i++) {
+                    if (i != missing) {
+                        xor_block(unit, stripe + i * EC_UNIT, EC_UNIT);
+                    }
+                }
+            }
+            
+            size_t stripe_len = min(left, (uint64_t) sizeof(stripe));
+            if (status == 0 && send(comm_fd, stripe, stripe_len, 0) != (ssize_t) stripe_len) {
+                status = -1;
+            }
+            left -= stripe_len;
+            transfer_slice(stripe_len);
+        }
+    }
+    
+    for (int i = 0; i < EC_SHARDS; i++) {
+        if (shard_fds[i] >= 0) {
+            close(shard_fds[i]);
+        }
+        pthread_mutex_unlock(file_mutexes[i]);
+    }
+    
+    if (status > 0) {
+        send_response(comm_fd, status, content_length, resource_name);
+        return -1;
+    }
+    
+    return status;
+}
+
+int open_segment(uint32_t segment, int flags) {
+    char segment_name[50];
+    snprintf(segment_name, 50, "%s/segment-%u", LOG_DIR, segment);
+    return open(segment_name, flags, 0667);
+}
+
+// reserves space for a record of length bytes at the end of the log and writes its
+// uncommitted header, must be called with log->mutex held
+int log_reserve(struct log_store* log, const char* name, uint64_t length, uint64_t seq, struct log_location* loc) {
+    uint64_t record_size = sizeof(struct log_record) + length;
+    
+    // rolls over to a new segment once the active one is full
+    if (log->active_size > 0 && log->active_size + record_size > LOG_SEGMENT_SIZE) {
+        int fd = open_segment(log->active_segment + 1, O_RDWR | O_CREAT | O_TRUNC);
+        if (fd < 0) {
+            return -1;
+        }
+        // the new segment's name has to be on disk before anything committed in it is
+        int dir_fd = open(LOG_DIR, O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0 || fsync(dir_fd) < 0) {
+            if (dir_fd >= 0) {
+                close(dir_fd);
+            }
+            close(fd);
+            return -1;
+        }
+        close(dir_fd);
+        log->active_segment++;
+        log->active_size = 0;
+        log->segment_fds[log->active_segment] = fd;
+        log->live_bytes[log->active_segment] = 0;
+    }
+    
+    loc->segment = log->active_segment;
+    loc->offset = log->active_size;
+    loc->length = length;
+    loc->seq = seq;
+    
+    struct log_record record;
+    memset(&record, 0, sizeof(record));
+    record.magic = LOG_RECORD_MAGIC;
+    record.seq = seq;
+    record.length = length;
+    strncpy(record.name, name, sizeof(record.name) - 1);
+    record.name[sizeof(record.name) - 1] = '\0';
+    
+    if (pwrite(log->segment_fds[loc->segment], &record, sizeof(record), loc->offset) != sizeof(record)) {
+        return -1;
+    }
+    
+    log->active_size += record_size;
+    log->reserved[loc->segment]++;
+    return 0;
+}
+
+// gives up a record from log_reserve without committing it, it stays uncommitted in
+// the segment and is never indexed, must be called with log->mutex held
+void log_release(struct log_store* log, struct log_location* loc) {
+    log->reserved[loc->segment]--;
+}
+
+// marks a reserved record of the segment fd as complete, its data is flushed before the
+// mark is written and the mark before this returns, so a record that's committed on disk
+// always has all of its data, called without log->mutex since only the writer of a
+// reserved record touches it
+int log_seal(int fd, struct log_location* loc, uint32_t digest) {
+    struct log_record record;
+    if (fdatasync(fd) < 0 || pread(fd, &record, sizeof(record), loc->offset) != sizeof(record)) {
+        return -1;
+    }
+    record.committed = 1;
+    record.digest = digest;
+    if (pwrite(fd, &record, sizeof(record), loc->offset) != sizeof(record) || fdatasync(fd) < 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+// points the index at a record sealed by log_seal, unless the index already holds a newer
+// copy, must be called with log->mutex held
+void log_commit(struct log_store* log, const char* name, struct log_location* loc) {
+    log_release(log, loc);
+    
+    string file_name(name);
+    if (log->index.count(file_name)) {
+        struct log_location* old_loc = &log->index[file_name];
+        if (old_loc->seq > loc->seq) {
+            return;
+        }
+        log->live_bytes[old_loc->segment] -= sizeof(struct log_record) + old_loc->length;
+    }
+    
+    log->index[file_name] = *loc;
+    log->live_bytes[loc->segment] += sizeof(struct log_record) + loc->length;
+}
+
+// reads every record of a segment into the index, keeping the newest seq of each name
+void log_scan_segment(struct log_store* log, uint32_t segment, int fd) {
+    unsigned char scan_buffer[BUFFER_SIZE];
+    uint64_t offset = 0;
+    struct log_record record;
+    
+    while (pread(fd, &record, sizeof(record), offset) == sizeof(record) && record.magic == LOG_RECORD_MAGIC) {
+        struct log_location loc;
+        loc.segment = segment;
+        loc.offset = offset;
+        loc.length = record.length;
+        loc.seq = record.seq;
+        
+        // only records that were fully written and whose data matches the digest count
+        uint32_t digest = 2166136261u;
+        uint64_t left = record.length;
+        uint64_t data_offset = offset + sizeof(record);
+        while (left > 0) {
+            ssize_t n = pread(fd, scan_buffer, left < BUFFER_SIZE ? left : BUFFER_SIZE, data_offset);
+            if (n <= 0) {
+                break;
+            }
+            digest = fnv1a(digest, scan_buffer, n);
+            left -= n;
+            data_offset += n;
+        }
+        
+        if (left > 0) {
+            // record was cut off by a crash, nothing after it is valid
+            break;
+        }
+        
+        if (record.seq >= log->next_seq) {
+            log->next_seq = record.seq + 1;
+        }
+        
+        char name[sizeof(record.name) + 1];
+        memcpy(name, record.name, sizeof(record.name));
+        name[sizeof(record.name)] = '\0';
+        string file_name(name);
+        
+        if (record.committed == 1 && record.digest == digest &&
+            (!log->index.count(file_name) || log->index[file_name].seq < loc.seq)) {
+            if (log->index.count(file_name)) {
+                struct log_location* old_loc = &log->index[file_name];
+                log->live_bytes[old_loc->segment] -= sizeof(struct log_record) + old_loc->length;
+            }
+            log->index[file_name] = loc;
+            log->live_bytes[segment] += sizeof(struct log_record) + loc.length;
+        }
+        
+        offset += sizeof(record) + record.length;
+    }
+    
+    // anything after the last valid record gets overwritten by new appends
+    if (segment == log->active_segment) {
+        log->active_size = offset;
+    }
+}
+
+// opens every segment in LOG_DIR and rebuilds the index from them
+int log_open(struct log_store* log) {
+    pthread_mutex_init(&log->mutex, NULL);
+    pthread_rwlock_init(&log->segments_rwlock, NULL);
+    log->active_segment = 0;
+    log->active_size = 0;
+    log->next_seq = 1;
+    
+    mkdir(LOG_DIR, 0777);
+    DIR* dir = opendir(LOG_DIR);
+    if (dir == NULL) {
+        return -1;
+    }
+    
+    struct dirent* ent;
+    while ((ent = readdir(dir))) {
+        unsigned int segment;
+        char extra;
+        if (sscanf(ent->d_name, "segment-%u%c", &segment, &extra) == 1) {
+            int fd = open_segment(segment, O_RDWR);
+            if (fd >= 0) {
+                log->segment_fds[segment] = fd;
+                log->live_bytes[segment] = 0;
+                log->active_segment = max(log->active_segment, (uint32_t) segment);
+            }
+        }
+    }
+    closedir(dir);
+    
+    if (log->segment_fds.empty()) {
+        int fd = open_segment(0, O_RDWR | O_CREAT | O_TRUNC);
+        if (fd < 0) {
+            return -1;
+        }
+        log->segment_fds[0] = fd;
+        log->live_bytes[0] = 0;
+    }
+    
+    // segments are scanned oldest first
+    for (map<uint32_t, int>::iterator it = log->segment_fds.begin(); it != log->segment_fds.end(); ++it) {
+        log_scan_segment(log, it->first, it->second);
+    }
+    
+    return 0;
+}
+
+int handle_put_log(int comm_fd, char buf[], char* resource_name, long content_length, struct shared_data* shared) {
+    struct log_store* log = shared->log;
+    
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    // resource_name points into buf, which gets overwritten by the body
+    char file_name[12];
+    strncpy(file_name, resource_name, sizeof(file_name) - 1);
+    file_name[sizeof(file_name) - 1] = '\0';
+    
+    // space in the log is reserved up front, so a body without a Content-Length is
+    // spooled to an unnamed temp file first to learn its length
+    int spool_fd = -1;
+    uint32_t digest = 2166136261u;
+    if (content_length < 0) {
+        spool_fd = open(LOG_DIR, O_TMPFILE | O_RDWR, 0600);
+        if (spool_fd < 0) {
+            send_response(comm_fd, 500, content_length, file_name);
+            return -1;
+        }
+        
+        // the body is read to the end even if the spool can't take it
+        bool spool_failed = false;
+        int n = recv(comm_fd, buf, BUFFER_SIZE, 0);
+        content_length = 0;
+        while (n > 0) {
+            spool_failed = spool_failed || write(spool_fd, buf, n) != n;
+            digest = fnv1a(digest, (unsigned char*) buf, n);
+            content_length += n;
+            n = recv(comm_fd, buf, BUFFER_SIZE, 0);
+        }
+        
+        if (spool_failed) {
+            close(spool_fd);
+            send_response(comm_fd, 500, content_length, file_name);
+            return -1;
+        }
+    }
+    
+    pthread_rwlock_rdlock(&log->segments_rwlock);
+    
+    pthread_mutex_lock(&log->mutex);
+    struct log_location loc;
+    int status = log_reserve(log, file_name, content_length, log->next_seq++, &loc);
+    int segment_fd = log->segment_fds[loc.segment];
+    pthread_mutex_unlock(&log->mutex);
+    
+    if (status < 0) {
+        pthread_rwlock_unlock(&log->segments_rwlock);
+        if (spool_fd >= 0) {
+            close(spool_fd);
+        }
+        send_response(comm_fd, 500, content_length, file_name);
+        return -1;
+    }
+    
+    // the body is written into the reserved space without holding any lock
+    off_t data_offset = loc.offset + sizeof(struct log_record);
+    if (spool_fd >= 0) {
+        off_t spool_offset = 0;
+        while (spool_offset < content_length) {
+            ssize_t n = copy_file_range(spool_fd, &spool_offset, segment_fd, &data_offset, content_length - spool_offset, 0);
+            if (n <= 0) {
+                status = -1;
+                break;
+            }
+        }
+        close(spool_fd);
+    } else {
+        long content_size = content_length;
+        while (content_size > 0) {
+            int n = recv(comm_fd, buf, body_chunk(content_length, content_size, BUFFER_SIZE), 0);
+            if (n <= 0) {
+                pthread_mutex_lock(&log->mutex);
+                log_release(log, &loc);
+                pthread_mutex_unlock(&log->mutex);
+                pthread_rwlock_unlock(&log->segments_rwlock);
+                return -1;
+            }
+            content_size -= n;
+            
+            // after a failed write the rest of the body is still read, so the 500
+            // goes out once the client is done sending
+            if (status == 0 && pwrite(segment_fd, buf, n, data_offset) != n) {
+                status = -1;
+            }
+            digest = fnv1a(digest, (unsigned char*) buf, n);
+            data_offset += n;
+            transfer_slice(n);
+        }
+    }
+    
+    if (status == 0) {
+        status = log_seal(segment_fd, &loc, digest);
+    }
+    
+    pthread_mutex_lock(&log->mutex);
+    if (status == 0) {
+        log_commit(log, file_name, &loc);
+    } else {
+        log_release(log, &loc);
+    }
+    pthread_mutex_unlock(&log->mutex);
+    
+    pthread_rwlock_unlock(&log->segments_rwlock);
+    
+    if (status < 0) {
+        send_response(comm_fd, 500, content_length, file_name);
+        return -1;
+    }
+    
+    // send 201 response
+    send_response(comm_fd, 201, content_length, file_name);
+    return 0;
+}
+
+int handle_get_log(int comm_fd, char buf[], char* resource_name, long content_length, struct shared_data* shared) {
+    struct log_store* log = shared->log;
+    
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    // segment can't be closed by compaction until the read lock is dropped
+    pthread_rwlock_rdlock(&log->segments_rwlock);
+    
+    pthread_mutex_lock(&log->mutex);
+    string file_name(resource_name);
+    bool found = log->index.count(file_name);
+    struct log_location loc;
+    int segment_fd = -1;
+    if (found) {
+        loc = log->index[file_name];
+        segment_fd = log->segment_fds[loc.segment];
+    }
+    pthread_mutex_unlock(&log->mutex);
+    
+    if (!found) {
+        pthread_rwlock_unlock(&log->segments_rwlock);
+        send_response(comm_fd, 404, content_length, resource_name);
+        return -1;
+    }
+    
+    // the data has to match the digest of its record before any of it goes out, it stays
+    // in the page cache for sendfile after
+    struct log_record record;
+    off_t offset = loc.offset + sizeof(struct log_record);
+    uint64_t left = loc.length;
+    bool intact = pread(segment_fd, &record, sizeof(record), loc.offset) == sizeof(record) && record.committed == 1;
+    uint32_t digest = 2166136261u;
+    while (intact && left > 0) {
+        ssize_t n = pread(segment_fd, buf, left < BUFFER_SIZE ? left : BUFFER_SIZE, offset);
+        if (n <= 0) {
+            intact = false;
+            break;
+        }
+        digest = fnv1a(digest, (unsigned char*) buf, n);
+        left -= n;
+        offset += n;
+    }
+    if (!intact || digest != record.digest) {
+        pthread_rwlock_unlock(&log->segments_rwlock);
+        send_response(comm_fd, 500, content_length, resource_name);
+        return -1;
+    }
+    
+    // Tells client how many bytes to expect
+    send_response(comm_fd, 200, loc.length, resource_name);
+    
+    // sends straight out of the segment
+    offset = loc.offset + sizeof(struct log_record);
+    left = loc.length;
+    int status = 0;
+    while (left > 0) {
+        ssize_t n = sendfile(comm_fd, segment_fd, &offset, left);
+        if (n <= 0) {
+            status = -1;
+            break;
+        }
+        left -= n;
+        transfer_slice(n);
+    }
+    
+    pthread_rwlock_unlock(&log->segments_rwlock);
+    return status;
+}
+
+// copies the live records out of a sealed segment to the end of the log, then deletes it
+void log_compact_segment(struct log_store* log, uint32_t segment) {
+    // collects the names whose newest copy is still in this segment
+    vector<string> names;
+    pthread_mutex_lock(&log->mutex);
+    for (unordered_map<string, struct log_location>::iterator it = log->index.begin(); it != log->index.end(); ++it) {
+        if (it->second.segment == segment) {
+            names.push_back(it->first);
+        }
+    }
+    pthread_mutex_unlock(&log->mutex);
+    
+    pthread_rwlock_rdlock(&log->segments_rwlock);
+    for (size_t i = 0; i < names.size(); i++) {
+        pthread_mutex_lock(&log->mutex);
+        struct log_location old_loc = log->index[names[i]];
+        if (old_loc.segment != segment) {
+            // overwritten since the names were collected
+            pthread_mutex_unlock(&log->mutex);
+            continue;
+        }
+        
+        // the copy keeps the old seq, so a newer PUT still wins on rebuild
+        struct log_location new_loc;
+        int status = log_reserve(log, names[i].c_str(), old_loc.length, old_loc.seq, &new_loc);
+        int old_fd = log->segment_fds[segment];
+        int new_fd = log->segment_fds[new_loc.segment];
+        struct log_record record;
+        if (status == 0 && pread(old_fd, &record, sizeof(record), old_loc.offset) != sizeof(record)) {
+            log_release(log, &new_loc);
+            status = -1;
+        }
+        pthread_mutex_unlock(&log->mutex);
+        
+        if (status < 0) {
+            pthread_rwlock_unlock(&log->segments_rwlock);
+            return;
+        }
+        
+        off_t in_offset = old_loc.offset + sizeof(struct log_record);
+        off_t out_offset = new_loc.offset + sizeof(struct log_record);
+        uint64_t left = old_loc.length;
+        while (left > 0) {
+            ssize_t n = copy_file_range(old_fd, &in_offset, new_fd, &out_offset, left, 0);
+            if (n <= 0) {
+                status = -1;
+                break;
+            }
+            left -= n;
+        }
+        
+        // the copy is on disk before the index moves off the old one
+        if (status == 0) {
+            status = log_seal(new_fd, &new_loc, record.digest);
+        }
+        
+        pthread_mutex_lock(&log->mutex);
+        if (status == 0) {
+            log_commit(log, names[i].c_str(), &new_loc);
+        } else {
+            log_release(log, &new_loc);
+        }
+        pthread_mutex_unlock(&log->mutex);
+        
+        // the segment is kept while any of its live records failed to copy
+        if (status < 0) {
+            pthread_rwlock_unlock(&log->segments_rwlock);
+            return;
+        }
+    }
+    
+    pthread_rwlock_unlock(&log->segments_rwlock);
+    
+    // waits for readers still using the segment before closing it
+    pthread_rwlock_wrlock(&log->segments_rwlock);
+    pthread_mutex_lock(&log->mutex);
+    close(log->segment_fds[segment]);
+    log->segment_fds.erase(segment);
+    log->live_bytes.erase(segment);
+    log->reserved.erase(segment);
+    pthread_mutex_unlock(&log->mutex);
+    pthread_rwlock_unlock(&log->segments_rwlock);
+    
+    char segment_name[50];
+    snprintf(segment_name, 50, "%s/segment-%u", LOG_DIR, segment);
+    unlink(segment_name);
+}
+
+// background thread that reclaims space taken by overwritten objects
+void* compactor(void* data) {
+    struct log_store* log = (struct log_store*) data;
+    while (1) {
+        sleep(LOG_COMPACT_INTERVAL);
+        
+        // picks sealed segments that are mostly dead data, skipping any a PUT still
+        // has a record reserved in, no new reservations land in a sealed segment so
+        // a segment picked here stays free of them
+        vector<uint32_t> victims;
+        pthread_mutex_lock(&log->mutex);
+        for (map<uint32_t, int>::iterator it = log->segment_fds.begin(); it != log->segment_fds.end(); ++it) {
+            if (it->first == log->active_segment || log->reserved[it->first] > 0) {
+                continue;
+            }
+            
+            struct stat st;
+            if (fstat(it->second, &st) == 0 &&
+                log->live_bytes[it->first] * 100 < (uint64_t) st.st_size * LOG_COMPACT_PERCENT) {
+                victims.push_back(it->first);
+            }
+        }
+        pthread_mutex_unlock(&log->mutex);
+        
+        for (size_t i = 0; i < victims.size(); i++) {
+            log_compact_segment(log, victims[i]);
+        }
+    }
+}
+
+typedef task<int> (*request_handler)(struct io_context* io, char buf[], char* resource_name, long content_length, struct shared_data* shared);
+
+// runs a handler that blocks on its socket as a coroutine that never parks
+template <int (*handler)(int comm_fd, char buf[], char* resource_name, long content_length, struct shared_data* shared)>
+task<int> blocking_handler(struct io_context* io, char buf[], char* resource_name, long content_length, struct shared_data* shared) {
+    co_return handler(io->fd, buf, resource_name, content_length, shared);
+}
+
+// handler that stores a PUT in the local store
+request_handler put_handler(struct shared_data* shared) {
+    if (shared->log != NULL) {
+        return &blocking_handler<handle_put_log>;
+    } else if (!shared->redundancy) {
+        return &handle_put;
+    } else if (shared->erasure) {
+        return &blocking_handler<handle_put_erasure>;
+    }
+    return &handle_put_redundancy;
+}
+
+// handler that serves a GET from the local store
+request_handler get_handler(struct shared_data* shared) {
+    if (shared->log != NULL) {
+        return &blocking_handler<handle_get_log>;
+    } else if (!shared->redundancy) {
+        return &handle_get;
+    } else if (shared->erasure) {
+        return &blocking_handler<handle_get_erasure>;
+    }
+    return &handle_get_redundancy;
+}
+
+// HEADs are answered by the stores that keep objects whole, NULL for the others
+request_handler head_handler(struct shared_data* shared) {
+    if (shared->log != NULL || shared->erasure) {
+        return NULL;
+    }
+    return shared->redundancy ? &handle_head_redundancy : &handle_head;
+}
+
+// sends all len bytes of data, without raising SIGPIPE if the other end is gone
+int send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+// receives a response header and returns its status code, or 0 if none came, the
+// Content-Length is left in content_length (-1 if it wasn't given)
+int recv_response(int fd, char buf[], long* content_length) {
+    *content_length = -1;
+    if (recv_header(fd, buf, NULL) <= 0) {
+        return 0;
+    }
+    
+    int status = 0;
+    sscanf(buf, "HTTP/1.1 %d", &status);
+    char* length = strstr(buf, "Content-Length:");
+    if (length != NULL) {
+        *content_length = strtol(length + strlen("Content-Length:"), NULL, 10);
+    }
+    
+    return status;
+}
+
+// copies length bytes of a body from from_fd to to_fd with recv and send, or everything
+// up to EOF when length is -1, returns the number of bytes copied or -1 on error
+long relay_copy(int from_fd, int to_fd, long length, char buf[]) {
+    long relayed = 0;
+    while (length < 0 || relayed < length) {
+        long want = BUFFER_SIZE;
+        if (length >= 0 && length - relayed < want) {
+            want = length - relayed;
+        }
+        
+        int n = recv(from_fd, buf, want, 0);
+        if (n <= 0) {
+            return length < 0 && n == 0 ? relayed : -1;
+        }
+        if (send_all(to_fd, buf, n) < 0) {
+            return -1;
+        }
+        relayed += n;
+        transfer_slice(n);
+    }
+    
+    return relayed;
+}
+
+// same as relay_copy, but the data goes through a pipe with splice so it's never copied
+// into user space, buf is only used if from_fd can't be spliced from
+long relay_body(int from_fd, int to_fd, long length, char buf[]) {
+    // each thread keeps its own pipe, it's always left empty between calls
+    static __thread int relay_pipe[2] = {-1, -1};
+    if (relay_pipe[0] < 0 && pipe2(relay_pipe, O_CLOEXEC) < 0) {
+        relay_pipe[0] = -1;
+        return relay_copy(from_fd, to_fd, length, buf);
+    }
+    
+    long relayed = 0;
+    while (length < 0 || relayed < length) {
+        long want = RELAY_CHUNK_SIZE;
+        if (length >= 0 && length - relayed < want) {
+            want = length - relayed;
+        }
+        
+        ssize_t n = splice(from_fd, NULL, relay_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINVAL && relayed == 0) {
+            return relay_copy(from_fd, to_fd, length, buf);
+        }
+        if (n <= 0) {
+            return length < 0 && n == 0 ? relayed : -1;
+        }
+        
+        for (ssize_t left = n; left > 0;) {
+            ssize_t m = splice(relay_pipe[0], NULL, to_fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m <= 0) {
+                // what's left in the pipe is thrown away with it
+                close(relay_pipe[0]);
+                close(relay_pipe[1]);
+                relay_pipe[0] = -1;
+                return -1;
+            }
+            left -= m;
+        }
+        relayed += n;
+        transfer_slice(n);
+    }
+    
+    return relayed;
+}
+
+// writes the Range and conditional headers of a request into lines, so a server it's passed
+// on to answers them as this one would have, returns their length
+int format_conditions(char lines[], const struct header* head) {
+    int k = 0;
+    lines[0] = '\0';
+    if (head == NULL) {
+        return 0;
+    }
+    
+    if (head->num_ranges > 0) {
+        k += snprintf(lines + k, CONDITION_LINES_SIZE - k, "Range: bytes=");
+        for (int i = 0; i < head->num_ranges; i++) {
+            const struct byte_range* r = &head->ranges[i];
+            const char* comma = i > 0 ? "," : "";
+            if (r->first < 0) {
+                k += snprintf(lines + k, CONDITION_LINES_SIZE - k, "%s-%ld", comma, r->last);
+            } else if (r->last < 0) {
+                k += snprintf(lines + k, CONDITION_LINES_SIZE - k, "%s%ld-", comma, r->first);
+            } else {
+                k += snprintf(lines + k, CONDITION_LINES_SIZE - k, "%s%ld-%ld", comma, r->first, r->last);
+            }
+        }
+        k += snprintf(lines + k, CONDITION_LINES_SIZE - k, "\r\n");
+    }
+    if (head->if_none_match[0] != '\0') {
+        k += snprintf(lines + k, CONDITION_LINES_SIZE - k, "If-None-Match: %s\r\n", head->if_none_match);
+    }
+    if (head->if_modified_since[0] != '\0') {
+        k += snprintf(lines + k, CONDITION_LINES_SIZE - k, "If-Modified-Since: %s\r\n", head->if_modified_since);
+    }
+    if (head->if_range[0] != '\0') {
+        k += snprintf(lines + k, CONDITION_LINES_SIZE - k, "If-Range: %s\r\n", head->if_range);
+    }
+    
+    return k;
+}
+
+// true for the statuses a GET or HEAD is answered with when the object is there
+bool object_found(int status) {
+    return status == 200 || status == 206 || status == 304 || status == 416;
+}
+
+// sends the client the response whose header recv_response left in buf as it is, status line
+// and headers included, then relays its body unless it has none, returns 0, or -1 if it was
+// cut short or ran to EOF so from_fd can't be used again
+int relay_response(int from_fd, int to_fd, char buf[], int status, long length, bool is_head) {
+    if (send_all(to_fd, buf, strlen(buf)) < 0) {
+        return -1;
+    }
+    if (is_head || status == 304 || length == 0) {
+        return 0;
+    }
+    
+    return relay_body(from_fd, to_fd, length, buf) == length && length > 0 ? 0 : -1;
+}
+
+// takes an idle keep-alive connection to a peer, or opens a new one when there is
+// none or reuse is false
+int peer_connect(struct peer* p, bool reuse) {
+    pthread_mutex_lock(&p->mutex);
+    while (reuse && !p->idle_fds.empty()) {
+        int peer_fd = p->idle_fds.back();
+        p->idle_fds.pop_back();
+        
+        // a connection the peer has since closed reads as EOF
+        char c;
+        if (recv(peer_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pthread_mutex_unlock(&p->mutex);
+            return peer_fd;
+        }
+        close(peer_fd);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    
+    int peer_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (peer_fd < 0) {
+        return -1;
+    }
+    
+    // a peer that stops responding can't hold a worker forever
+    struct timeval timeout;
+    timeout.tv_sec = PEER_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(peer_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(peer_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int one = 1;
+    setsockopt(peer_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    if (connect(peer_fd, (struct sockaddr*) &p->addr, sizeof(p->addr)) < 0) {
+        close(peer_fd);
+        return -1;
+    }
+    
+    return peer_fd;
+}
+
+// gives a connection back to the pool once its response has been read in full
+void peer_release(struct peer* p, int peer_fd) {
+    pthread_mutex_lock(&p->mutex);
+    p->idle_fds.push_back(peer_fd);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+// a request served by the local store on a thread of its own through a socketpair, so
+// the local store looks like one more peer and its response can be checked before
+// anything is sent to the client
+struct local_request {
+    request_handler handler;
+    struct shared_data* shared;
+    // the handler's end of the socketpair
+    int handler_fd;
+    // our end of the socketpair
+    int fd;
+    char name[12];
+    long content_length;
+    // a copy of the client's header for the handler to answer its Range and conditions,
+    // the client's buffer is reused while the handler runs
+    struct header head;
+    char command[8];
+    bool has_head;
+    char buf[BUFFER_SIZE];
+    pthread_t thread;
+};
+
+void* local_request_thread(void* data) {
+    struct local_request* local = (struct local_request*) data;
+    struct io_context io = {local->handler_fd, NULL, local->shared};
+    io.head = local->has_head ? &local->head : NULL;
+    run_blocking(local->handler(&io, local->buf, local->name, local->content_length, local->shared));
+    close(local->handler_fd);
+    release_thread_buffers();
+    return NULL;
+}
+
+int start_local_request(struct local_request* local, request_handler handler, const char* name,
+    long content_length, const struct header* head, struct shared_data* shared) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return -1;
+    }
+    
+    local->handler = handler;
+    local->shared = shared;
+    local->fd = fds[0];
+    local->handler_fd = fds[1];
+    strncpy(local->name, name, sizeof(local->name) - 1);
+    local->name[sizeof(local->name) - 1] = '\0';
+    local->content_length = content_length;
+    local->has_head = head != NULL;
+    if (head != NULL) {
+        local->head = *head;
+        snprintf(local->command, sizeof(local->command), "%s", head->command);
+        local->head.command = local->command;
+        local->head.resource_name = local->name;
+    }
+    
+    if (pthread_create(&local->thread, NULL, &local_request_thread, local) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// waits for the local request to finish, a handler still sending gets EPIPE
+void finish_local_request(struct local_request* local) {
+    close(local->fd);
+    pthread_join(local->thread, NULL);
+}
+
+// stores a PUT locally and streams the body to every peer at the same time, the
+// client gets its response as soon as peer_quorum of them (the local store included)
+// have acknowledged it
+int handle_put_peers(int comm_fd, char buf[], char* resource_name, long content_length, struct shared_data* shared) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    // resource_name points into buf, which gets overwritten by the body
+    char name[12];
+    strncpy(name, resource_name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    
+    // replica 0 is the local store, the rest are the peers
+    int num_peers = shared->peers.size();
+    vector<int> replica_fds(num_peers + 1, -1);
+    struct local_request local;
+    if (start_local_request(&local, put_handler(shared), name, content_length, NULL, shared) == 0) {
+        replica_fds[0] = local.fd;
+    }
+    
+    // a body without a Content-Length ends at EOF, so it can't go over a pooled connection
+    char request[100];
+    if (content_length >= 0) {
+        snprintf(request, 100, "PUT /%s HTTP/1.1\r\nContent-Length: %ld\r\n" PEER_HEADER " 1\r\n\r\n", name, content_length);
+    } else {
+        snprintf(request, 100, "PUT /%s HTTP/1.1\r\n" PEER_HEADER " 1\r\n\r\n", name);
+    }
+    for (int i = 1; i <= num_peers; i++) {
+        replica_fds[i] = peer_connect(shared->peers[i-1], content_length >= 0);
+        if (replica_fds[i] >= 0 && send_all(replica_fds[i], request, strlen(request)) < 0) {
+            close(replica_fds[i]);
+            replica_fds[i] = -1;
+        }
+    }
+    
+    // streams the body to every replica as it comes in, a replica that can't keep up
+    // is dropped (the local store may have stopped reading because it failed, its
+    // response is still read below)
+    bool local_sending = replica_fds[0] >= 0;
+    long content_size = content_length;
+    int status = 0;
+    while (content_length < 0 || content_size > 0) {
+        int n = recv(comm_fd, buf, body_chunk(content_length, content_size, BUFFER_SIZE), 0);
+        if (n <= 0) {
+            if (content_length < 0 && n == 0) {
+                break;
+            }
+            status = -1;
+            break;
+        }
+        content_size -= n;
+        
+        if (local_sending && send_all(replica_fds[0], buf, n) < 0) {
+            local_sending = false;
+        }
+        for (int i = 1; i <= num_peers; i++) {
+            if (replica_fds[i] >= 0 && send_all(replica_fds[i], buf, n) < 0) {
+                close(replica_fds[i]);
+                replica_fds[i] = -1;
+            }
+        }
+        transfer_slice(n);
+    }
+    
+    if (status == 0 && content_length < 0) {
+        for (int i = 0; i <= num_peers; i++) {
+            if (replica_fds[i] >= 0) {
+                shutdown(replica_fds[i], SHUT_WR);
+            }
+        }
+    }
+    
+    // collects the responses in the order they arrive, the client is answered as soon
+    // as the quorum is reached
+    int acks = 0;
+    bool answered = false;
+    vector<struct pollfd> pending;
+    for (int i = 0; status == 0 && i <= num_peers; i++) {
+        if (replica_fds[i] >= 0) {
+            struct pollfd pfd;
+            pfd.fd = replica_fds[i];
+            pfd.events = POLLIN;
+            pending.push_back(pfd);
+        }
+    }
+    while (!pending.empty() && poll(pending.data(), pending.size(), PEER_TIMEOUT * 1000) > 0) {
+        for (size_t j = 0; j < pending.size(); j++) {
+            if (pending[j].revents == 0) {
+                continue;
+            }
+            
+            int i = find(replica_fds.begin(), replica_fds.end(), pending[j].fd) - replica_fds.begin();
+            long response_length;
+            int response_status = recv_response(replica_fds[i], buf, &response_length);
+            if (response_status == 201) {
+                acks++;
+            }
+            if (acks == shared->peer_quorum && !answered) {
+                send_response(comm_fd, 201, content_length, name);
+                answered = true;
+            }
+            
+            // the local socketpair is closed by finish_local_request
+            if (i > 0 && response_status != 0 && content_length >= 0 && response_length == 0) {
+                peer_release(shared->peers[i-1], replica_fds[i]);
+            } else if (i > 0) {
+                close(replica_fds[i]);
+            }
+            pending.erase(pending.begin() + j);
+            j--;
+        }
+    }
+    
+    // peers that didn't answer in time
+    for (size_t j = 0; j < pending.size(); j++) {
+        if (pending[j].fd != replica_fds[0]) {
+            close(pending[j].fd);
+        }
+    }
+    for (int i = 1; status < 0 && i <= num_peers; i++) {
+        if (replica_fds[i] >= 0) {
+            close(replica_fds[i]);
+        }
+    }
+    if (replica_fds[0] >= 0) {
+        finish_local_request(&local);
+    }
+    
+    if (status < 0) {
+        return -1;
+    }
+    if (!answered) {
+        send_response(comm_fd, 500, content_length, name);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// serves a GET from the local store, and from each of fallbacks in turn when the local
+// copy is missing or fails its checks, whichever has it answers the client's Range and
+// conditions and its response is relayed as it is
+int get_with_failover(int comm_fd, char buf[], const char* name, long content_length, struct shared_data* shared,
+    const vector<struct peer*>& fallbacks, const struct header* head) {
+    char conditions[CONDITION_LINES_SIZE];
+    format_conditions(conditions, head);
+    
+    struct local_request local;
+    long response_length;
+    int local_status = 500;
+    if (start_local_request(&local, get_handler(shared), name, content_length, head, shared) == 0) {
+        local_status = recv_response(local.fd, buf, &response_length);
+        if (object_found(local_status)) {
+            int relayed = relay_response(local.fd, comm_fd, buf, local_status, response_length, false);
+            finish_local_request(&local);
+            return relayed;
+        }
+        finish_local_request(&local);
+    }
+    
+    char request[100 + CONDITION_LINES_SIZE];
+    snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\n%s" PEER_HEADER " 1\r\n\r\n", name, conditions);
+    for (size_t i = 0; i < fallbacks.size(); i++) {
+        int peer_fd = peer_connect(fallbacks[i], true);
+        if (peer_fd < 0) {
+            continue;
+        }
+        if (send_all(peer_fd, request, strlen(request)) < 0) {
+            close(peer_fd);
+            continue;
+        }
+        
+        int peer_status = recv_response(peer_fd, buf, &response_length);
+        if (object_found(peer_status)) {
+            if (relay_response(peer_fd, comm_fd, buf, peer_status, response_length, false) < 0) {
+                close(peer_fd);
+                return -1;
+            }
+            peer_release(fallbacks[i], peer_fd);
+            return 0;
+        }
+        
+        if (peer_status != 0 && response_length == 0) {
+            peer_release(fallbacks[i], peer_fd);
+        } else {
+            close(peer_fd);
+        }
+    }
+    
+    // nobody had it, the local store's answer stands
+    send_response(comm_fd, local_status == 0 ? 500 : local_status, content_length, (char*) name);
+    return -1;
+}
+
+// serves a GET from the local store, and from the peers in turn when the local copy
+// is missing or fails its checks
+int handle_get_peers(int comm_fd, char buf[], char* resource_name, long content_length, struct shared_data* shared,
+    const struct header* head) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    char name[12];
+    strncpy(name, resource_name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    
+    return get_with_failover(comm_fd, buf, name, content_length, shared, shared->peers, head);
+}
+
+// hash used to place both vnodes and keys on the ring, FNV-1a with a final mix
+// so names that differ only in their last characters still spread out
+uint32_t ring_hash(const char* data, size_t len) {
+    uint32_t hash = fnv1a(2166136261u, (const unsigned char*) data, len);
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// adds a member to the ring if it isn't on it yet, id is "ip:port", returns true if it was new
+bool cluster_add_member(struct cluster* c, const string& id) {
+    size_t colon = id.rfind(':');
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (colon == string::npos || inet_pton(AF_INET, id.substr(0, colon).c_str(), &addr.sin_addr) != 1) {
+        return false;
+    }
+    addr.sin_port = htons(atoi(id.c_str() + colon + 1));
+    
+    pthread_rwlock_wrlock(&c->rwlock);
+    if (find(c->member_ids.begin(), c->member_ids.end(), id) != c->member_ids.end()) {
+        pthread_rwlock_unlock(&c->rwlock);
+        return false;
+    }
+    
+    struct peer* p = new struct peer;
+    p->addr = addr;
+    pthread_mutex_init(&p->mutex, NULL);
+    c->members.push_back(p);
+    c->member_ids.push_back(id);
+    
+    // only the arcs just in front of the new member's vnodes change owner
+    int index = c->members.size() - 1;
+    for (int i = 0; i < CLUSTER_VNODES; i++) {
+        char vnode[50];
+        int k = snprintf(vnode, 50, "%s#%d", id.c_str(), i);
+        c->ring.push_back(make_pair(ring_hash(vnode, k), index));
+    }
+    sort(c->ring.begin(), c->ring.end());
+    pthread_rwlock_unlock(&c->rwlock);
+    
+    return true;
+}
+
+// returns the index of the member that owns a key, the first vnode at or after the key's
+// hash, or with skip_self the first one after that which isn't this node (the owner the
+// key had before this node joined)
+int cluster_owner(struct cluster* c, const char* name, bool skip_self) {
+    uint32_t hash = ring_hash(name, strlen(name));
+    
+    pthread_rwlock_rdlock(&c->rwlock);
+    size_t start = lower_bound(c->ring.begin(), c->ring.end(), make_pair(hash, -1)) - c->ring.begin();
+    int owner = c->self;
+    for (size_t i = 0; i < c->ring.size(); i++) {
+        int member = c->ring[(start + i) % c->ring.size()].second;
+        if (!skip_self || member != c->self) {
+            owner = member;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&c->rwlock);
+    
+    return owner;
+}
+
+struct peer* cluster_member(struct cluster* c, int index) {
+    pthread_rwlock_rdlock(&c->rwlock);
+    struct peer* p = c->members[index];
+    pthread_rwlock_unlock(&c->rwlock);
+    return p;
+}
+
+// wakes the rebalancing thread up
+void cluster_rebalance(struct cluster* c) {
+    pthread_mutex_lock(&c->rebalance_mutex);
+    c->rebalance_needed = true;
+    pthread_cond_signal(&c->rebalance_cond);
+    pthread_mutex_unlock(&c->rebalance_mutex);
+}
+
+// passes a request on to another server and relays its response as it is, status line and
+// headers included, returns the status sent to the client, -1 if the response was cut
+// short, or 0 if the server couldn't be reached, in which case nothing was sent or taken
+// from the client and the request can be tried somewhere else, from_peer marks the request
+// to be served by the target itself, a GET or HEAD takes the client's Range and conditions along
+int forward_request(int comm_fd, char buf[], const char* command, const char* name, long content_length, struct peer* target,
+    bool from_peer, const struct header* head) {
+    bool is_put = strcmp(command, "PUT") == 0;
+    bool is_head = strcmp(command, "HEAD") == 0;
+    
+    // a body without a Content-Length ends at EOF, so it can't go over a pooled connection
+    char request[100 + CONDITION_LINES_SIZE];
+    const char* peer_header = from_peer ? PEER_HEADER " 1\r\n" : "";
+    if (is_put && content_length >= 0) {
+        snprintf(request, sizeof(request), "PUT /%s HTTP/1.1\r\nContent-Length: %ld\r\n%s\r\n", name, content_length, peer_header);
+    } else if (is_put) {
+        snprintf(request, sizeof(request), "PUT /%s HTTP/1.1\r\n%s\r\n", name, peer_header);
+    } else {
+        char conditions[CONDITION_LINES_SIZE];
+        format_conditions(conditions, head);
+        snprintf(request, sizeof(request), "%s /%s HTTP/1.1\r\n%s%s\r\n", command, name, conditions, peer_header);
+    }
+    bool reuse = !is_put || content_length >= 0;
+    int target_fd = peer_connect(target, reuse);
+    if (target_fd < 0) {
+        return 0;
+    }
+    if (send_all(target_fd, request, strlen(request)) < 0) {
+        close(target_fd);
+        return 0;
+    }
+    
+    if (is_put) {
+        if (relay_body(comm_fd, target_fd, content_length, buf) < 0) {
+            close(target_fd);
+            send_response(comm_fd, 500, content_length, (char*) name);
+            return 500;
+        }
+        if (content_length < 0) {
+            shutdown(target_fd, SHUT_WR);
+        }
+    }
+    
+    long response_length;
+    int status = recv_response(target_fd, buf, &response_length);
+    if (status == 0) {
+        close(target_fd);
+        send_response(comm_fd, 500, content_length, (char*) name);
+        return 500;
+    }
+    
+    if (relay_response(target_fd, comm_fd, buf, status, response_length, is_head) < 0) {
+        close(target_fd);
+        return -1;
+    }
+    
+    if (reuse) {
+        peer_release(target, target_fd);
+    } else {
+        close(target_fd);
+    }
+    
+    return status;
+}
+
+// passes a request for a key owned by another node on to it, and relays the response
+int handle_proxy(int comm_fd, char buf[], const char* command, char* resource_name, long content_length, struct peer* owner,
+    const struct header* head) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    char name[12];
+    strncpy(name, resource_name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    
+    int status = forward_request(comm_fd, buf, command, name, content_length, owner, true, head);
+    if (status == 0) {
+        send_response(comm_fd, 500, content_length, name);
+    }
+    
+    return status == 201 || object_found(status) ? 0 : -1;
+}
+
+// serves a GET for a key this node owns, falling back to the key's previous owner in case
+// it hasn't been handed over yet
+int handle_get_cluster(int comm_fd, char buf[], char* resource_name, long content_length, struct shared_data* shared,
+    const struct header* head) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    char name[12];
+    strncpy(name, resource_name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    
+    vector<struct peer*> fallbacks;
+    int previous = cluster_owner(shared->cluster, name, true);
+    if (previous != shared->cluster->self) {
+        fallbacks.push_back(cluster_member(shared->cluster, previous));
+    }
+    
+    return get_with_failover(comm_fd, buf, name, content_length, shared, fallbacks, head);
+}
+
+// answers a handoff PUT for an object that was written here since the ring changed, the
+// body is thrown away so the newer data stays
+int handle_stale_handoff(int comm_fd, char buf[], char* resource_name, long content_length) {
+    long content_size = content_length;
+    while (content_size > 0) {
+        int n = recv(comm_fd, buf, body_chunk(content_length, content_size, BUFFER_SIZE), 0);
+        if (n <= 0) {
+            return -1;
+        }
+        content_size -= n;
+    }
+    
+    send_response(comm_fd, 201, content_length, resource_name);
+    return 0;
+}
+
+// adds the node named in a JOIN request to the ring, and answers with every member this
+// node knows of so the new node learns about the rest of the cluster
+int handle_join(int comm_fd, char* resource_name, struct shared_data* shared) {
+    struct cluster* c = shared->cluster;
+    if (resource_name[0] == '/' && cluster_add_member(c, resource_name + 1)) {
+        cluster_rebalance(c);
+    }
+    
+    string members;
+    pthread_rwlock_rdlock(&c->rwlock);
+    for (size_t i = 0; i < c->member_ids.size(); i++) {
+        members += c->member_ids[i] + "\n";
+    }
+    pthread_rwlock_unlock(&c->rwlock);
+    
+    send_response(comm_fd, 200, members.size(), resource_name);
+    return send_all(comm_fd, members.data(), members.size());
+}
+
+// announces this node to every member it knows of, learning about more members from
+// their answers as it goes
+void* joiner(void* data) {
+    struct shared_data* shared = (struct shared_data*) data;
+    struct cluster* c = shared->cluster;
+    char join_buffer[BUFFER_SIZE];
+    
+    pthread_rwlock_rdlock(&c->rwlock);
+    string request = "JOIN /" + c->member_ids[c->self] + " HTTP/1.1\r\n\r\n";
+    pthread_rwlock_unlock(&c->rwlock);
+    
+    for (size_t i = 0; ; i++) {
+        pthread_rwlock_rdlock(&c->rwlock);
+        bool done = i >= c->members.size();
+        struct peer* p = done ? NULL : c->members[i];
+        string id = done ? "" : c->member_ids[i];
+        pthread_rwlock_unlock(&c->rwlock);
+        
+        if (done) {
+            break;
+        }
+        if ((int) i == c->self) {
+            continue;
+        }
+        
+        int member_fd = peer_connect(p, false);
+        long response_length;
+        if (member_fd < 0 || send_all(member_fd, request.data(), request.size()) < 0 ||
+            recv_response(member_fd, join_buffer, &response_length) != 200) {
+            fprintf(stderr, "Couldn't join cluster member %s\n", id.c_str());
+            if (member_fd >= 0) {
+                close(member_fd);
+            }
+            continue;
+        }
+        
+        string members;
+        int n;
+        while ((long) members.size() < response_length && (n = recv(member_fd, join_buffer, BUFFER_SIZE, 0)) > 0) {
+            members.append(join_buffer, n);
+        }
+        close(member_fd);
+        
+        size_t start = 0;
+        size_t end;
+        while ((end = members.find('\n', start)) != string::npos) {
+            cluster_add_member(c, members.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+    
+    // keys this node kept from before it (re)joined may belong elsewhere now
+    cluster_rebalance(c);
+    return NULL;
+}
+
+// names of every object stored on this node
+vector<string> local_object_names(struct shared_data* shared) {
+    unordered_set<string> names;
+    pthread_mutex_lock(&shared->file_mutex_map_mutex);
+    for (unordered_set<string>::iterator it = shared->known_files.begin(); it != shared->known_files.end(); ++it) {
+        size_t slash = it->find('/');
+        names.insert(slash == string::npos ? *it : it->substr(slash + 1));
+    }
+    pthread_mutex_unlock(&shared->file_mutex_map_mutex);
+    
+    return vector<string>(names.begin(), names.end());
+}
+
+bool has_local_object(struct shared_data* shared, const char* name) {
+    if (!shared->redundancy) {
+        return is_known_file(shared, name);
+    }
+    for (size_t i = 1; i <= shared->replica_roots.size(); i++) {
+        if (is_known_file(shared, replica_key(i, name))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// removes every copy of an object from this node once it has been handed over
+void remove_local_object(struct shared_data* shared, const char* name) {
+    int first_copy = shared->redundancy ? 1 : 0;
+    int last_copy = shared->redundancy ? shared->replica_roots.size() : 0;
+    
+    for (int copy = first_copy; copy <= last_copy; copy++) {
+        string key = copy == 0 ? string(name) : replica_key(copy, name);
+        pthread_mutex_t* file_mutex = find_file_mutex(shared, key);
+        pthread_mutex_lock(file_mutex);
+        
+        char path[PATH_SIZE];
+        object_path(path, copy_root(shared, copy), name, shared->sharded);
+        unlink(path);
+        remove_flat_copy(shared, copy, name);
+        
+        pthread_mutex_lock(&shared->file_mutex_map_mutex);
+        shared->known_files.erase(key);
+        pthread_mutex_unlock(&shared->file_mutex_map_mutex);
+        
+        pthread_mutex_unlock(file_mutex);
+    }
+}
+
+// copies an object to its new owner with a handoff PUT, which the owner ignores if
+// it was written there since
+int handoff_object(struct shared_data* shared, const char* name, struct peer* owner, char buf[]) {
+    struct local_request local;
+    if (start_local_request(&local, get_handler(shared), name, -1, NULL, shared) < 0) {
+        return -1;
+    }
+    
+    long length;
+    int status = recv_response(local.fd, buf, &length);
+    int owner_fd = -1;
+    if (status == 200 && length >= 0 && (owner_fd = peer_connect(owner, true)) >= 0) {
+        char request[150];
+        snprintf(request, 150, "PUT /%s HTTP/1.1\r\nContent-Length: %ld\r\n" PEER_HEADER " 1\r\n" HANDOFF_HEADER " 1\r\n\r\n",
+            name, length);
+        status = 0;
+        if (send_all(owner_fd, request, strlen(request)) == 0 && relay_body(local.fd, owner_fd, length, buf) == length) {
+            status = recv_response(owner_fd, buf, &length);
+        }
+    }
+    finish_local_request(&local);
+    
+    if (owner_fd >= 0) {
+        if (status == 201) {
+            peer_release(owner, owner_fd);
+        } else {
+            close(owner_fd);
+        }
+    }
+    
+    return status == 201 ? 0 : -1;
+}
+
+// moves objects this node no longer owns to their owners whenever the ring changes
+void* rebalancer(void* data) {
+    struct shared_data* shared = (struct shared_data*) data;
+    struct cluster* c = shared->cluster;
+    char rebalance_buffer[BUFFER_SIZE];
+    
+    while (1) {
+        pthread_mutex_lock(&c->rebalance_mutex);
+        while (!c->rebalance_needed) {
+            pthread_cond_wait(&c->rebalance_cond, &c->rebalance_mutex);
+        }
+        c->rebalance_needed = false;
+        pthread_mutex_unlock(&c->rebalance_mutex);
+        
+        vector<string> names = local_object_names(shared);
+        unsigned long moved = 0;
+        for (size_t i = 0; i < names.size(); i++) {
+            int owner = cluster_owner(c, names[i].c_str(), false);
+            if (owner == c->self) {
+                continue;
+            }
+            
+            if (handoff_object(shared, names[i].c_str(), cluster_member(c, owner), rebalance_buffer) == 0) {
+                remove_local_object(shared, names[i].c_str());
+                moved++;
+            }
+        }
+        
+        if (moved > 0) {
+            c->keys_moved += moved;
+            fprintf(stderr, "Rebalance moved %lu keys\n", moved);
+        }
+    }
+    
+    return NULL;
+}
+
+// picks the backend for a request, healthy backends only unless there are none
+struct backend* choose_backend(struct shared_data* shared) {
+    vector<struct backend*> candidates;
+    for (size_t i = 0; i < shared->backends.size(); i++) {
+        if (shared->backends[i]->healthy) {
+            candidates.push_back(shared->backends[i]);
+        }
+    }
+    if (candidates.empty()) {
+        candidates = shared->backends;
+    }
+    int n = candidates.size();
+    
+    // power of two choices, the less loaded of two random backends
+    if (shared->balance_policy == BALANCE_TWO_CHOICES && n >= 2) {
+        static __thread unsigned int seed = 0;
+        if (seed == 0) {
+            seed = (unsigned int) pthread_self() ^ time(NULL);
+        }
+        int first = rand_r(&seed) % n;
+        int second = rand_r(&seed) % (n - 1);
+        if (second >= first) {
+            second++;
+        }
+        return candidates[second]->outstanding < candidates[first]->outstanding ? candidates[second] : candidates[first];
+    }
+    
+    // least outstanding requests
+    int start = shared->next_backend++ % n;
+    struct backend* chosen = candidates[start];
+    for (int i = 1; i < n; i++) {
+        struct backend* b = candidates[(start + i) % n];
+        if (b->outstanding < chosen->outstanding) {
+            chosen = b;
+        }
+    }
+    
+    return chosen;
+}
+
+// counts a request against a backend, which is ejected after too many failures in a row
+void backend_result(struct backend* b, bool ok) {
+    if (ok) {
+        b->failures = 0;
+        return;
+    }
+    
+    if (++b->failures >= BACKEND_EJECT_FAILURES && b->healthy.exchange(false)) {
+        b->ejected_at = time(NULL);
+        fprintf(stderr, "Ejected backend %s after %d failures\n", b->id.c_str(), (int) b->failures);
+    }
+}
+
+// passes a request on to one of the backends, a backend that can't be reached is
+// skipped and the next choice is tried
+int handle_balance(int comm_fd, char buf[], const char* command, char* resource_name, long content_length, struct shared_data* shared,
+    const struct header* head) {
+    // removes '/'
+    if (resource_name[0] == '/') {
+        memmove(resource_name, resource_name+1, strlen(resource_name));
+    }
+    
+    char name[12];
+    strncpy(name, resource_name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    
+    int status = 0;
+    for (size_t attempt = 0; attempt < shared->backends.size() && status == 0; attempt++) {
+        struct backend* b = choose_backend(shared);
+        b->outstanding++;
+        status = forward_request(comm_fd, buf, command, name, content_length, &b->conn, false, head);
+        b->outstanding--;
+        
+        // a cut short response may just as well be the client's doing
+        if (status >= 0) {
+            backend_result(b, status != 0 && status != 500);
+        }
+    }
+    
+    if (status == 0) {
+        send_response(comm_fd, 500, content_length, name);
+    }
+    
+    return status == 201 || object_found(status) ? 0 : -1;
+}
+
+// checks every backend that isn't sitting out an ejection, a backend is healthy if it
+// answers a request at all (a bad name gets a quick 400)
+void* health_checker(void* data) {
+    struct shared_data* shared = (struct shared_data*) data;
+    char check_buffer[BUFFER_SIZE];
+    const char* request = "GET /health HTTP/1.1\r\n\r\n";
+    
+    while (1) {
+        sleep(BACKEND_CHECK_INTERVAL);
+        
+        for (size_t i = 0; i < shared->backends.size(); i++) {
+            struct backend* b = shared->backends[i];
+            if (!b->healthy && b->failures >= BACKEND_EJECT_FAILURES && time(NULL) - b->ejected_at < BACKEND_EJECT_TIME) {
+                continue;
+            }
+            
+            long length;
+            int check_fd = peer_connect(&b->conn, false);
+            bool ok = check_fd >= 0 && send_all(check_fd, request, strlen(request)) == 0 &&
+                recv_response(check_fd, check_buffer, &length) != 0;
+            if (check_fd >= 0) {
+                close(check_fd);
+            }
+            
+            if (ok && !b->healthy) {
+                fprintf(stderr, "Backend %s is healthy\n", b->id.c_str());
+                b->failures = 0;
+            } else if (!ok && b->healthy) {
+                fprintf(stderr, "Backend %s failed its health check\n", b->id.c_str());
+            }
+            b->healthy = ok;
+        }
+    }
+    
+    return NULL;
+}
+
+// a directory for the startup scan to read
+struct scan_task {
+    string path;
+    // prefix for the names found, the replica_key prefix with redundancy
+    string key_prefix;
+    // levels of shard dirs between path and the files
+    int depth;
+};
+
+// tasks shared by the scan threads, and the names they find
+struct scan_state {
+    vector<struct scan_task> tasks;
+    size_t next;
+    pthread_mutex_t lock;
+    unordered_set<string>* known_files;
+};
+
+// reads one directory with large getdents64 batches, descending depth levels of shard dirs
+void scan_dir(const string& path, const string& key_prefix, int depth, vector<string>& found, char* scan_buffer) {
+    int dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        return;
+    }
+    
+    vector<string> subdirs;
+    long n;
+    while ((n = syscall(SYS_getdents64, dir_fd, scan_buffer, SCAN_BUFFER_SIZE)) > 0) {
+        for (long pos = 0; pos < n;) {
+            struct dirent64* ent = (struct dirent64*) (scan_buffer + pos);
+            pos += ent->d_reclen;
+            
+            if (ent->d_name[0] == '.') {
+                continue;
+            }
+            
+            if (depth > 0) {
+                if (ent->d_type == DT_DIR || ent->d_type == DT_UNKNOWN) {
+                    subdirs.push_back(ent->d_name);
+                }
+            } else if (is_valid_name(ent->d_name) && ent->d_type != DT_DIR &&
+                !(path == "." && strcmp(ent->d_name, "httpserver") == 0)) { // skip the executable
+                found.push_back(key_prefix + ent->d_name);
+            }
+        }
+    }
+    close(dir_fd);
     
-    head.content_length = -1;
+    // the batch buffer is reused by the next level down, so it is only descended into afterwards
+    for (size_t i = 0; i < subdirs.size(); i++) {
+        scan_dir(path + "/" + subdirs[i], key_prefix, depth - 1, found, scan_buffer);
+    }
+}
+
+void* scan_worker(void* data) {
+    struct scan_state* state = (struct scan_state*) data;
+    char* scan_buffer = (char*) malloc(SCAN_BUFFER_SIZE);
+    vector<string> found;
     
-    while ((token = strtok(NULL, " ")) != NULL) {
-        if (strstr(token, "\r\n\r\n") != NULL) {
-            // marks end of header
+    while (1) {
+        pthread_mutex_lock(&state->lock);
+        size_t i = state->next++;
+        pthread_mutex_unlock(&state->lock);
+        
+        if (i >= state->tasks.size()) {
             break;
         }
         
-        if (strstr(token, "Content-Length") != NULL) {
-            token = strtok(NULL, " ");
-            char *p = token;
-            long len;
-            while (isdigit(*p) && *p != '\\') {
-                len = strtol(p, &p, 10);
-            }
-            head.content_length = len;
-        }
+        struct scan_task* task = &state->tasks[i];
+        scan_dir(task->path, task->key_prefix, task->depth, found, scan_buffer);
     }
+    free(scan_buffer);
     
-    return head;
+    pthread_mutex_lock(&state->lock);
+    state->known_files->insert(found.begin(), found.end());
+    pthread_mutex_unlock(&state->lock);
+    
+    return NULL;
 }
 
-int send_response(int comm_fd, int response_num, int content_len, char* resource_name) {
-    char response_1[200];
-    const char* response_2;
+// finds every file in the server using one thread per core, replica_roots is empty
+// when there is no redundancy
+void scan_files(const vector<string>& replica_roots, bool sharded, unordered_set<string>& known_files) {
+    struct scan_state state;
+    state.next = 0;
+    state.known_files = &known_files;
+    pthread_mutex_init(&state.lock, NULL);
     
-    if (response_num == 400) {
-        int k = snprintf(response_1, 200, "HTTP/1.1 400 Bad Request\r\nContent-Length: %d\r\n\r\n", content_len);
-        response_1[k] = '\0';
-        send(comm_fd, response_1, strlen(response_1), 0);
+    int first_copy = replica_roots.empty() ? 0 : 1;
+    int last_copy = replica_roots.size();
+    for (int copy = first_copy; copy <= last_copy; copy++) {
+        string root = copy == 0 ? "." : replica_roots[copy-1];
+        string key_prefix = copy == 0 ? "" : replica_key(copy, "");
         
-    } else if (response_num == 403) {
-        response_2 = "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n";
-        send(comm_fd, response_2, strlen(response_2), 0);
-        warn("404 File %s Forbidden Access\n", resource_name);
-        
-    } else if (response_num == 404) {
-        response_2 = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-        send(comm_fd, response_2, strlen(response_2), 0);
-        warn("404 File %s Not Found\n", resource_name);
-        
-    } else if (response_num == 500) {
-        response_2 = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
-        send(comm_fd, response_2, strlen(response_2), 0);
-        warn("500 Internal Server Error While Opening %s\n", resource_name);
+        // files still in (or only ever in) the flat layout
+        struct scan_task task;
+        task.path = root;
+        task.key_prefix = key_prefix;
+        task.depth = 0;
+        state.tasks.push_back(task);
         
-    } else if (response_num == 200) {
-        int k = snprintf(response_1, 200, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", content_len);
-        response_1[k] = '\0';
-        send(comm_fd, response_1, strlen(response_1), 0);
+        if (!sharded) {
+            continue;
+        }
         
-    } else if (response_num == 201) {
-        response_2 = "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
-        send(comm_fd, response_2, strlen(response_2), 0);
+        // every first level shard dir is a task of its own, so they get spread over threads
+        string shard_root = copy == 0 ? SHARD_DIR : root;
+        DIR* dir = opendir(shard_root.c_str());
+        struct dirent* ent;
+        while (dir != NULL && (ent = readdir(dir))) {
+            if (ent->d_name[0] != '.') {
+                task.path = shard_root + "/" + ent->d_name;
+                task.depth = 1;
+                state.tasks.push_back(task);
+            }
+        }
+        if (dir != NULL) {
+            closedir(dir);
+        }
     }
     
-    return 0;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > (long) state.tasks.size()) {
+        num_threads = state.tasks.size();
+    }
+    
+    vector<pthread_t> threads;
+    for (long i = 1; i < num_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, &scan_worker, &state) == 0) {
+            threads.push_back(thread);
+        }
+    }
+    scan_worker(&state);
+    
+    for (size_t i = 0; i < threads.size(); i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&state.lock);
 }
 
-// source: section recording
-unsigned long getaddr(char* name) {
-    unsigned long res;
-    struct addrinfo hints;
-    struct addrinfo* info;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    if (getaddrinfo(name, NULL, &hints, &info) || info == NULL) {
-        fprintf(stderr, "error finding %s\n", name);
-        exit(1);
+// first line of the manifest, the settings it was written with
+string manifest_settings(const vector<string>& replica_roots, bool sharded) {
+    char settings[50];
+    snprintf(settings, 50, "%s %d %d", MANIFEST_MAGIC, !replica_roots.empty(), sharded);
+    
+    string line = settings;
+    for (size_t i = 0; i < replica_roots.size(); i++) {
+        line += " " + replica_roots[i];
     }
-
-    res = ((struct sockaddr_in*)info->ai_addr)->sin_addr.s_addr;
-    freeaddrinfo(info);
-    return res;
+    
+    return line + "\n";
 }
 
-int compare_two_files(const char* file1, const char* file2) {
-    int fd1 = open(file1, O_RDONLY);
-    int fd2 = open(file2, O_RDONLY);
-    
-    if (fd1 < 0 || fd2 < 0) {
+// loads the list of files saved by the last clean shutdown, the manifest is removed
+// right away so a crash before the next clean shutdown forces a scan
+bool load_manifest(const vector<string>& replica_roots, bool sharded, unordered_set<string>& known_files) {
+    int fd = open(MANIFEST_FILE, O_RDONLY);
+    if (fd < 0) {
         return false;
     }
-        
-    char buf1[SMALL_BUF_SIZE];
-    char buf2[SMALL_BUF_SIZE];
+    unlink(MANIFEST_FILE);
     
-    long size1 = 1;
-    long size2 = 1;
-    
-    // compares char by char
-    while (size1 != 0 && size2 != 0) {
-        size1 = read(fd1, buf1, SMALL_BUF_SIZE);
-        size2 = read(fd2, buf2, SMALL_BUF_SIZE);
-        
-        if (size1 == 1 && size2 == 1) {
-            if (buf1[0] != buf2[0]) {
-                close(fd1);
-                close(fd2);
-                return false;
-            }
-        }
-        
+    string contents;
+    char read_buffer[BUFFER_SIZE];
+    int n;
+    while ((n = read(fd, read_buffer, BUFFER_SIZE)) > 0) {
+        contents.append(read_buffer, n);
     }
+    close(fd);
     
-    if (size1 != size2) {
-        close(fd1);
-        close(fd2);
+    // first line has the settings the manifest was written with, it's only
+    // usable if they match
+    string expected = manifest_settings(replica_roots, sharded);
+    if (n < 0 || contents.compare(0, expected.size(), expected) != 0) {
         return false;
     }
     
-    close(fd1);
-    close(fd2);
+    size_t start = expected.size();
+    size_t end;
+    while ((end = contents.find('\n', start)) != string::npos) {
+        known_files.insert(contents.substr(start, end - start));
+        start = end + 1;
+    }
     
     return true;
 }
 
-int get_which_file(const char* file1, const char* file2, const char* file3) {
-    int status1 = compare_two_files(file1, file2);
-    int status2 = compare_two_files(file1, file3);
-    int status3 = compare_two_files(file2, file3);
+// writes the list of known files for the next startup
+int save_manifest(struct shared_data* shared) {
+    string contents = manifest_settings(shared->replica_roots, shared->sharded);
     
-    if (status1 == 1) {
-        return 1; // file1 and file2 are equal, return 1 for file1
-    } else if (status2 == 1) {
-        return 1; // file1 and file3 are equal, return 1 for file1
-    } else if (status3 == 1) {
-        return 2; // file2 and file3 are equal, return 2 for file2
+    pthread_mutex_lock(&shared->file_mutex_map_mutex);
+    for (unordered_set<string>::iterator it = shared->known_files.begin(); it != shared->known_files.end(); ++it) {
+        contents += *it;
+        contents += '\n';
     }
+    pthread_mutex_unlock(&shared->file_mutex_map_mutex);
     
-    // None of the files are equal, so return -1 (error)
-    return -1;
-}
-
-int handle_put(int comm_fd, char buf[], char* resource_name, int content_length, struct shared_data* shared) {
-    // removes '/'
-    if (resource_name[0] == '/') {
-        memmove(resource_name, resource_name+1, strlen(resource_name));
+    char temp_name[50];
+    snprintf(temp_name, 50, "%s.tmp", MANIFEST_FILE);
+    int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return -1;
     }
-
-    // cast char* to std::string
-    // file name 
-    string file_name(resource_name);
-
-    // gets mutex(es) and locks file(s)
-    // if file hasnt been encountered before and isnt in the map, insert into map
-    if (!shared->file_mutex_map.count(file_name)) {
-        pthread_mutex_t file_mutex;
-        pthread_mutex_init(&file_mutex, NULL);
-        shared->file_mutex_map[file_name] = file_mutex;
+    
+    size_t written = 0;
+    while (written < contents.size()) {
+        ssize_t n = write(fd, contents.data() + written, contents.size() - written);
+        if (n <= 0) {
+            close(fd);
+            unlink(temp_name);
+            return -1;
+        }
+        written += n;
     }
-    // locks mutex for a file
-    pthread_mutex_lock(&shared->file_mutex_map[file_name]);
+    fsync(fd);
+    close(fd);
+    
+    return rename(temp_name, MANIFEST_FILE);
+}
 
-    // opens file name for writing
-    int open_fd;
+// waits for SIGINT or SIGTERM, then saves the manifest and exits
+void* shutdown_handler(void* data) {
+    struct shared_data* shared = (struct shared_data*) data;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
     
-    open_fd = open(resource_name, O_RDWR | O_CREAT | O_TRUNC, 0667);
+    int sig;
+    sigwait(&signals, &sig);
     
-    if (open_fd < 0) {
-        if (errno == EACCES) {
-            send_response(comm_fd, 403, content_length, resource_name);
-            return -1;
-        } else {
-            // send 500 response
-            send_response(comm_fd, 500, content_length, resource_name);
-            return -1;
-        }
+    if (shared->redundancy && !shared->erasure) {
+        fprintf(stderr, "Read repair: %lu divergences detected, %lu repaired\n",
+            shared->divergences_detected.load(), shared->divergences_repaired.load());
     }
     
-    // if content length is specified
-    if (content_length > -1) {
-        int content_size = content_length;
-        // while there is still content left to be read
-        while (content_size > 0) {
-            // read from client
-            int n = recv(comm_fd, buf, BUFFER_SIZE, 0);
-            if (n <= 0) {
-                return -1;
-            }
-            // subtract number read of bytes from content_size
-            content_size -= n;
+    fprintf(stderr, "Timed out connections: %lu idle, %lu in a header, %lu in a body\n",
+        shared->timers.reaped[PHASE_IDLE].load(), shared->timers.reaped[PHASE_HEADER].load(),
+        shared->timers.reaped[PHASE_BODY].load());
+    
+    // files still being migrated would be missed by the manifest, so let the next startup scan
+    if (shared->log == NULL && !shared->migrating && save_manifest(shared) < 0) {
+        fprintf(stderr, "Error saving manifest: %d\n", errno);
+    }
+    exit(0);
+}
 
-            // write to file
-            write(open_fd, buf, n);
+// moves files left in the flat layout into the sharded layout while the server runs
+void* migrator(void* data) {
+    struct shared_data* shared = (struct shared_data*) data;
+    int first_copy = shared->redundancy ? 1 : 0;
+    int last_copy = shared->redundancy ? shared->replica_roots.size() : 0;
+    
+    for (int copy = first_copy; copy <= last_copy; copy++) {
+        const char* dir_name = copy == 0 ? "." : copy_root(shared, copy);
+        
+        DIR* dir = opendir(dir_name);
+        if (dir == NULL) {
+            continue;
         }
-
-        close(open_fd);
         
-        // send 201 response
-        send_response(comm_fd, 201, content_length, resource_name);
-    } else { // content length not specified, so read until EOF
-        // read from client
-        int n = recv(comm_fd, buf, BUFFER_SIZE, 0);
-        // write to file until no bytes from input
-        while (n > 0) {
-            // write to file
-            write(open_fd, buf, n);
+        struct dirent* ent;
+        while ((ent = readdir(dir))) {
+            // skip the executable, it has a valid object name
+            if (!is_valid_name(ent->d_name) || ent->d_type != DT_REG || strcmp(ent->d_name, "httpserver") == 0) {
+                continue;
+            }
             
-            n = recv(comm_fd, buf, BUFFER_SIZE, 0);
+            string file_name = copy == 0 ? string(ent->d_name) : replica_key(copy, ent->d_name);
+            pthread_mutex_t* file_mutex = find_file_mutex(shared, file_name);
+            
+            // the file lock keeps GETs from missing the file halfway through the move,
+            // and a PUT that got there first has already removed the flat copy
+            pthread_mutex_lock(file_mutex);
+            char flat_path[PATH_SIZE];
+            char sharded_path[PATH_SIZE];
+            object_path(flat_path, copy_root(shared, copy), ent->d_name, false);
+            object_path(sharded_path, copy_root(shared, copy), ent->d_name, true);
+            make_parent_dirs(sharded_path);
+            rename(flat_path, sharded_path);
+            pthread_mutex_unlock(file_mutex);
         }
-
-        close(open_fd);
-        
-        // send 201 response
-        send_response(comm_fd, 201, content_length, resource_name);
+        closedir(dir);
     }
-
-    // unlocks mutex(es) for the file(s)
-    pthread_mutex_unlock(&shared->file_mutex_map[file_name]);
     
-    return 0;
+    shared->migrating = false;
+    return NULL;
 }
 
-int handle_put_redundancy(int comm_fd, char buf[], char* resource_name, int content_length, struct shared_data* shared) {
-    // removes '/'
-    if (resource_name[0] == '/') {
-        memmove(resource_name, resource_name+1, strlen(resource_name));
+// starts timing a connection a worker has taken on, it starts out idle
+struct connection* open_connection(struct timer_wheel* wheel, int fd) {
+    struct connection* conn = new (slab_alloc(&wheel->connections)) struct connection;
+    conn->fd = fd;
+    conn->wheel = wheel;
+    pthread_mutex_init(&conn->mutex, NULL);
+    conn->closed = false;
+    conn->last_unsent = 0;
+    conn->resume = nullptr;
+    socklen_t cpu_size = sizeof(conn->cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &conn->cpu, &cpu_size) < 0) {
+        conn->cpu = -1;
     }
+    set_phase(conn, PHASE_IDLE);
+    
+    // files it under the slot its idle timeout ends in, or the last one this turn
+    pthread_mutex_lock(&wheel->mutex);
+    uint64_t due = min(conn->deadline.load(), wheel->now + TIMER_SLOTS - 1);
+    wheel->slots[due % TIMER_SLOTS].push_back(conn);
+    pthread_mutex_unlock(&wheel->mutex);
+    return conn;
+}
 
-    // cast char* to std::string
-    // file name
-    string file_name(resource_name);
-    // file names in case of redundancy
-    string file1 = "copy1/" + file_name;
-    string file2 = "copy2/" + file_name;
-    string file3 = "copy3/" + file_name;
-    
-    // if copy[1-3]/file hasnt been seen yet, insert 3 new entries into map
-    if (!shared->file_mutex_map.count(file1) || !shared->file_mutex_map.count(file2) || !shared->file_mutex_map.count(file3)) {
-        pthread_mutex_t file_mutex1;
-        pthread_mutex_init(&file_mutex1, NULL);
-        shared->file_mutex_map[file1] = file_mutex1;
-        pthread_mutex_t file_mutex2;
-        pthread_mutex_init(&file_mutex2, NULL);
-        shared->file_mutex_map[file2] = file_mutex2;
-        pthread_mutex_t file_mutex3;
-        pthread_mutex_init(&file_mutex3, NULL);
-        shared->file_mutex_map[file3] = file_mutex3;
-    }
-    // locks mutex for 3 files
-    pthread_mutex_lock(&shared->file_mutex_map[file1]);
-    pthread_mutex_lock(&shared->file_mutex_map[file2]);
-    pthread_mutex_lock(&shared->file_mutex_map[file3]);
-    
-    // opens file name for writing
-    int open_fd;
-    int open_fd_2;
-    int open_fd_3;
-    
-    char file_name_1[50];
-    char file_name_2[50];
-    char file_name_3[50];
-    
-    sprintf(file_name_1, "copy1/%s", resource_name);
-    sprintf(file_name_2, "copy2/%s", resource_name);
-    sprintf(file_name_3, "copy3/%s", resource_name);
-            
-    open_fd = open(file_name_1, O_RDWR | O_CREAT | O_TRUNC, 0667);
-    open_fd_2 = open(file_name_2, O_RDWR | O_CREAT | O_TRUNC, 0667);
-    open_fd_3 = open(file_name_3, O_RDWR | O_CREAT | O_TRUNC, 0667);
-    
-    if ((open_fd < 0 && open_fd_2 < 0) || (open_fd < 0 && open_fd_3 < 0) ||
-        (open_fd_2 < 0 && open_fd_3 < 0)) {
-        if (errno == EACCES) {
-            send_response(comm_fd, 403, content_length, resource_name);
-            return -1;
-        } else {
-            // send 500 response
-            send_response(comm_fd, 500, content_length, resource_name);
-            return -1;
-        }
+// closes a connection a worker is done with, the reaper frees it later
+void close_connection(struct connection* conn) {
+    pthread_mutex_lock(&conn->mutex);
+    close(conn->fd);
+    conn->closed = true;
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+// whether a connection in its body phase has moved bytes either way since the reaper
+// last looked, a slow transfer only times out once it stops altogether
+bool transfer_progressing(struct connection* conn) {
+    struct tcp_info info;
+    socklen_t info_size = sizeof(info);
+    int unsent = 0;
+    if (getsockopt(conn->fd, IPPROTO_TCP, TCP_INFO, &info, &info_size) < 0 ||
+        ioctl(conn->fd, SIOCOUTQ, &unsent) < 0) {
+        return false;
     }
     
-    // if content length is specified
-    if (content_length > -1) {
-        int content_size = content_length;
-        // while there is still content left to be read
-        while (content_size > 0) {
-            // read from client
-            int n = recv(comm_fd, buf, BUFFER_SIZE, 0);
-            if (n <= 0) {
-                return -1;
-            }
-            // subtract number read of bytes from content_size
-            content_size -= n;
-
-            // write to files
-            write(open_fd, buf, n);
-            write(open_fd_2, buf, n);
-            write(open_fd_3, buf, n);
-            
-        }
+    uint64_t timeout_ms = conn->wheel->timeouts[PHASE_BODY] * TIMER_TICK_MS;
+    bool progressing = info.tcpi_last_data_recv < timeout_ms || (unsent != 0 && unsent != conn->last_unsent);
+    conn->last_unsent = unsent;
+    return progressing;
+}
 
-        close(open_fd);
-        close(open_fd_2);
-        close(open_fd_3);
+// turns the timer wheel once a tick, shutting down connections whose timeout has passed,
+// which ends the recv or send their worker is stuck in so it closes them and moves on
+void* reaper(void* data) {
+    struct timer_wheel* wheel = (struct timer_wheel*) data;
+    vector<struct connection*> due;
+    while (1) {
+        usleep(TIMER_TICK_MS * 1000);
         
-        // send 201 response
-        send_response(comm_fd, 201, content_length, resource_name);
-    } else { // content length not specified, so read until EOF
-        // read from client
-        int n = recv(comm_fd, buf, BUFFER_SIZE, 0);
-        // write to file until no bytes from input
-        while (n > 0) {
-            // write to file
-            write(open_fd, buf, n);
-            write(open_fd_2, buf, n);
-            write(open_fd_3, buf, n);
+        pthread_mutex_lock(&wheel->mutex);
+        uint64_t now = ++wheel->now;
+        due.swap(wheel->slots[now % TIMER_SLOTS]);
+        pthread_mutex_unlock(&wheel->mutex);
+        
+        for (size_t i = 0; i < due.size(); i++) {
+            struct connection* conn = due[i];
             
-            n = recv(comm_fd, buf, BUFFER_SIZE, 0);
+            pthread_mutex_lock(&conn->mutex);
+            if (conn->closed) {
+                pthread_mutex_unlock(&conn->mutex);
+                pthread_mutex_destroy(&conn->mutex);
+                slab_free(&wheel->connections, conn);
+                continue;
+            }
+            
+            // deadlines only move later, so one that hasn't passed just gets filed again
+            if (conn->deadline <= now) {
+                int phase = conn->phase;
+                if (phase == PHASE_BODY && transfer_progressing(conn)) {
+                    conn->deadline = now + wheel->timeouts[PHASE_BODY];
+                } else {
+                    shutdown(conn->fd, SHUT_RDWR);
+                    wheel->reaped[phase]++;
+                    // looked at again a turn later, by when the worker will have closed it
+                    conn->deadline = now + TIMER_SLOTS - 1;
+                }
+            }
+            pthread_mutex_unlock(&conn->mutex);
+            
+            uint64_t next = min(conn->deadline.load(), now + TIMER_SLOTS - 1);
+            pthread_mutex_lock(&wheel->mutex);
+            wheel->slots[next % TIMER_SLOTS].push_back(conn);
+            pthread_mutex_unlock(&wheel->mutex);
         }
+        due.clear();
+    }
+}
 
-        close(open_fd);
-        close(open_fd_2);
-        close(open_fd_3);
-        
-        // send 201 response
-        send_response(comm_fd, 201, content_length, resource_name);
+// waits in the epoll set for a connection's next request, dropping the connection if
+// it can't be added
+void park_connection(struct shared_data* shared, struct connection* conn, int op) {
+    set_phase(conn, PHASE_IDLE);
+    struct epoll_event event;
+    // one shot, so a connection is only ever handed to one worker at a time
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = conn;
+    if (epoll_ctl(shared->epoll_fd, op, conn->fd, &event) < 0) {
+        close_connection(conn);
     }
+}
 
-    // unlocks mutex(es) for the file(s)
-    pthread_mutex_unlock(&shared->file_mutex_map[file1]);
-    pthread_mutex_unlock(&shared->file_mutex_map[file2]);
-    pthread_mutex_unlock(&shared->file_mutex_map[file3]);
-    
-    return 0;
+// size of an object PUT since startup, -1 if it isn't known
+long known_object_size(struct shared_data* shared, const char* name) {
+    long size = -1;
+    pthread_mutex_lock(&shared->object_sizes_mutex);
+    unordered_map<string, long>::iterator it = shared->object_sizes.find(name);
+    if (it != shared->object_sizes.end()) {
+        size = it->second;
+    }
+    pthread_mutex_unlock(&shared->object_sizes_mutex);
+    return size;
 }
 
-int handle_get(int comm_fd, char buf[], char* resource_name, int content_length, struct shared_data* shared) {
-    // removes '/'
-    if (resource_name[0] == '/') {
-        memmove(resource_name, resource_name+1, strlen(resource_name));
+// remembers the size of an object that was PUT, or forgets it if it isn't known
+void record_object_size(struct shared_data* shared, const string& name, long size) {
+    pthread_mutex_lock(&shared->object_sizes_mutex);
+    if (size < 0) {
+        shared->object_sizes.erase(name);
+    } else {
+        shared->object_sizes[name] = size;
     }
-    
-    // cast char* to std::string
-    // file name 
-    string file_name(resource_name);
-    
-    // if file hasnt been encountered before, then invalid GET request
-    if (!shared->file_mutex_map.count(file_name)) {
-        send_response(comm_fd, 404, content_length, resource_name);
-        return -1;
+    pthread_mutex_unlock(&shared->object_sizes_mutex);
+}
+
+// picks the class of the request waiting on a connection from its method and its body's
+// Content-Length, or for a GET the size of the object, peeking at the header so it stays
+// in the socket for the worker
+int request_class(struct shared_data* shared, struct connection* conn, char buf[]) {
+    conn->name[0] = '\0';
+    int n = recv(conn->fd, buf, BUFFER_SIZE - 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n <= 0) {
+        // closed or shut down, the worker only has to close it
+        return CLASS_SMALL;
+    }
+    buf[n] = '\0';
+    if (strstr(buf, "\r\n\r\n") == NULL) {
+        // the rest of the header is still on its way
+        return CLASS_MEDIUM;
     }
-    // locks mutex for a file
-    pthread_mutex_lock(&shared->file_mutex_map[file_name]);
     
-    int open_fd;
+    char command[8];
+    char resource_name[16];
+    if (sscanf(buf, "%7s %15s", command, resource_name) != 2) {
+        return CLASS_SMALL;
+    }
+    if (strlen(resource_name) == 11) {
+        strcpy(conn->name, resource_name + 1);
+    }
     
-    open_fd = open(resource_name, O_RDONLY);
-        
-    // send appropriate response
-    if (open_fd < 0) {
-        // named file does not exist, send 404 response
-        if (errno == ENOENT) {
-            send_response(comm_fd, 404, content_length, resource_name);
-            return -1;
-        }
-        // named file cannot be opened due to permissions
-        else if (errno == EACCES) {
-            send_response(comm_fd, 403, content_length, resource_name);
-            return -1;
+    long size;
+    if (strcmp(command, "PUT") == 0) {
+        char* length = strstr(buf, "Content-Length:");
+        if (length == NULL) {
+            // read until the client closes, so it could be any size
+            return CLASS_BULK;
         }
-        else {
-            // send 500 response
-            send_response(comm_fd, 500, content_length, resource_name);
-            return -1;
+        size = strtol(length + strlen("Content-Length:"), NULL, 10);
+    } else if (strcmp(command, "GET") == 0) {
+        size = known_object_size(shared, conn->name);
+        if (size < 0) {
+            return CLASS_MEDIUM;
         }
+    } else {
+        return CLASS_SMALL;
     }
     
-    int content_len = 0;
-    unsigned char* get_buffer = (unsigned char*) malloc(BUFFER_SIZE * sizeof(unsigned char));
-        
-    // Gets Content-Length before sending a response
-    int size = read(open_fd, get_buffer, BUFFER_SIZE);
+    if (size <= SMALL_REQUEST_SIZE) {
+        return CLASS_SMALL;
+    }
+    return size <= MEDIUM_REQUEST_SIZE ? CLASS_MEDIUM : CLASS_BULK;
+}
+
+// puts a connection on an active deque of a worker pinned to the CPU its packets arrive
+// on, so its data is still in that CPU's cache, or on the next active deque round robin
+void enqueue_ready(struct shared_data* shared, struct connection* conn) {
+    struct worker_pool* pool = &shared->pool;
+    bool pushed = false;
+    if (conn->cpu >= 0 && conn->cpu < (int) pool->cpu_deques.size()) {
+        vector<int>& local = pool->cpu_deques[conn->cpu];
+        for (size_t i = 0; i < local.size() && !pushed; i++) {
+            // connections on one CPU are spread over its workers by fd
+            struct work_deque* d = shared->deques[local[(conn->fd + i) % local.size()]];
+            pthread_mutex_lock(&d->mutex);
+            if (d->active) {
+                d->items[conn->priority].push_back(conn);
+                pushed = true;
+            }
+            pthread_mutex_unlock(&d->mutex);
+        }
+    }
     
-    while (size != 0) {
-        if (size < 0) {
-            send_response(comm_fd, 500, content_length, resource_name);
-            free(get_buffer);
-            return -1;
+    // there is always an active deque, but the one picked may stop being active before
+    // it is locked
+    while (!pushed) {
+        struct work_deque* d = shared->deques[shared->next_deque++ % shared->deques.size()];
+        pthread_mutex_lock(&d->mutex);
+        if (d->active) {
+            d->items[conn->priority].push_back(conn);
+            pushed = true;
         }
-                            
-        content_len += size;
-        
-        size = read(open_fd, get_buffer, BUFFER_SIZE);
+        pthread_mutex_unlock(&d->mutex);
     }
+    shared->ready_count++;
     
-    close(open_fd);
-        
-    open_fd = open(resource_name, O_RDONLY);
-        
-    // Tells client how many bytes to expect
-    send_response(comm_fd, 200, content_len, resource_name);
+    pthread_mutex_lock(&shared->idle_mutex);
+    pthread_cond_signal(&shared->worker_cond);
+    pthread_mutex_unlock(&shared->idle_mutex);
+}
 
-    // Sends the data of size Content-Length
-    size = read(open_fd, get_buffer, BUFFER_SIZE);
+// hands a connection with a request ready to the workers, or one whose parked request
+// can carry on, which keeps the class it was given
+void push_ready(struct shared_data* shared, struct connection* conn, char buf[]) {
+    if (!conn->resume) {
+        conn->priority = request_class(shared, conn, buf);
+    }
+    conn->ready_at = shared->timers.now;
+    conn->ready_us = now_us();
+    enqueue_ready(shared, conn);
+}
+
+// whether a bulk request for the object is being served in slices
+bool is_sliced(struct shared_data* shared, const char* name) {
+    pthread_mutex_lock(&shared->sliced_names_mutex);
+    bool sliced = shared->sliced_names.count(name) > 0;
+    pthread_mutex_unlock(&shared->sliced_names_mutex);
+    return sliced;
+}
+
+// picks the next connection to serve from the classes up to max_class, NULL if there is none:
+// the lowest class wins, but a request moves up a class for every AGING_TICKS it has waited,
+// and on a tie the worker's own deque wins, which it takes the oldest connection from while
+// steals take the newest; skip_sliced leaves requests for objects being served in slices
+struct connection* take_ready(struct shared_data* shared, int index, int max_class, bool skip_sliced) {
+    int num_deques = shared->deques.size();
+    uint64_t now = shared->timers.now;
     
-    while (size != 0) {
-        if (size < 0) {
-            send_response(comm_fd, 500, content_length, resource_name);
-            return -1;
+    // the connection picked may be taken by another worker before it can be popped
+    while (shared->ready_count > 0) {
+        int best_deque = -1;
+        int best_class = 0;
+        int best_rank = max_class + 1;
+        bool best_front = false;
+        for (int i = 0; i < num_deques && best_rank > 0; i++) {
+            struct work_deque* d = shared->deques[(index + i) % num_deques];
+            // inactive deques are always empty
+            if (!d->active) {
+                continue;
+            }
+            pthread_mutex_lock(&d->mutex);
+            for (int c = 0; c <= max_class; c++) {
+                if (d->items[c].empty()) {
+                    continue;
+                }
+                struct connection* oldest = d->items[c].front();
+                int rank = max(0, c - (int) ((now - oldest->ready_at) / AGING_TICKS));
+                // an aged request is taken by whoever gets to it first
+                bool front = i == 0 || rank < c;
+                struct connection* conn = front ? oldest : d->items[c].back();
+                if (rank < best_rank && !(skip_sliced && is_sliced(shared, conn->name))) {
+                    best_deque = (index + i) % num_deques;
+                    best_class = c;
+                    best_rank = rank;
+                    best_front = front;
+                }
+            }
+            pthread_mutex_unlock(&d->mutex);
         }
-                                    
-        int n = send(comm_fd, get_buffer, size, 0);
-        if (n == -1) {
-            return -1;
+        if (best_deque < 0) {
+            return NULL;
+        }
+        
+        struct work_deque* d = shared->deques[best_deque];
+        deque<struct connection*>& items = d->items[best_class];
+        struct connection* conn = NULL;
+        pthread_mutex_lock(&d->mutex);
+        if (!items.empty()) {
+            conn = best_front ? items.front() : items.back();
+            if (skip_sliced && is_sliced(shared, conn->name)) {
+                conn = NULL;
+            } else if (best_front) {
+                items.pop_front();
+            } else {
+                items.pop_back();
+            }
         }
+        pthread_mutex_unlock(&d->mutex);
         
-        size = read(open_fd, get_buffer, BUFFER_SIZE);
+        if (conn != NULL) {
+            shared->ready_count--;
+            shared->pool.wait_us += now_us() - conn->ready_us;
+            shared->pool.waited++;
+            return conn;
+        }
     }
-
-    close(open_fd);
-    free(get_buffer);
-
-    // unlocks mutex(es) for the file(s)
-    pthread_mutex_unlock(&shared->file_mutex_map[file_name]);
-    
-    return 0;
+    return NULL;
 }
 
-int handle_get_redundancy(int comm_fd, char buf[], char* resource_name, int content_length, struct shared_data* shared) {
-    // removes '/'
-    if (resource_name[0] == '/') {
-        memmove(resource_name, resource_name+1, strlen(resource_name));
+// accepts connections and waits for requests on the ones between requests, passing
+// each connection to the workers once a request starts to arrive on it
+void* dispatcher(void* data) {
+    struct shared_data* shared = (struct shared_data*) data;
+    struct epoll_event events[EPOLL_EVENTS];
+    // for peeking at headers
+    char peek_buffer[BUFFER_SIZE];
+    while (1) {
+        int n = epoll_wait(shared->epoll_fd, events, EPOLL_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            // the listening socket is the one without a connection
+            if (events[i].data.ptr == NULL) {
+                // gets communication fd
+                int comm_fd = accept(shared->listen_fd, NULL, NULL);
+                if (comm_fd >= 0) {
+                    park_connection(shared, open_connection(&shared->timers, comm_fd), EPOLL_CTL_ADD);
+                }
+            } else {
+                push_ready(shared, (struct connection*) events[i].data.ptr, peek_buffer);
+            }
+        }
     }
+}
+
+// answers a GET of METRICS_PATH with the worker pool's size and resizes, how long requests
+// wait for a worker, the connections timed out and the buffer pool and connection slab, one
+// "name value" per line
+int handle_metrics(int comm_fd, struct shared_data* shared) {
+    struct worker_pool* pool = &shared->pool;
+    pthread_mutex_lock(&shared->idle_mutex);
+    int size = pool->size;
+    int idle = pool->idle;
+    pthread_mutex_unlock(&shared->idle_mutex);
     
-    // cast char* to std::string
-    // file name
-    string file_name(resource_name);
-    // file names in case of redundancy
-    string file1 = "copy1/" + file_name;
-    string file2 = "copy2/" + file_name;
-    string file3 = "copy3/" + file_name;
+    char body[2048];
+    int length = snprintf(body, sizeof(body),
+        "workers %d\nworkers_idle %d\nworkers_min %d\nworkers_max %d\n"
+        "workers_grown %lu\nworkers_shrunk %lu\nlast_resize %s\n"
+        "queue_wait_us %lu\nblocked_percent %d\nready_requests %d\n"
+        "timed_out_idle %lu\ntimed_out_header %lu\ntimed_out_body %lu\n",
+        size, idle, pool->min, pool->max,
+        pool->grown.load(), pool->shrunk.load(), pool->last_resize.load(),
+        (unsigned long) pool->last_wait_us.load(), pool->last_blocked_percent.load(), shared->ready_count.load(),
+        shared->timers.reaped[PHASE_IDLE].load(), shared->timers.reaped[PHASE_HEADER].load(),
+        shared->timers.reaped[PHASE_BODY].load());
     
-    if (!shared->file_mutex_map.count(file1) || !shared->file_mutex_map.count(file2) || !shared->file_mutex_map.count(file3)) {
-        send_response(comm_fd, 404, content_length, resource_name);
-        return -1;
-    }
-    // locks mutex for a file
-    pthread_mutex_lock(&shared->file_mutex_map[file1]);
-    pthread_mutex_lock(&shared->file_mutex_map[file2]);
-    pthread_mutex_lock(&shared->file_mutex_map[file3]);
-    
-    int open_fd;
-    int open_fd_2;
-    int open_fd_3;
-    char file_name_1[50];
-    char file_name_2[50];
-    char file_name_3[50];
-    
-    sprintf(file_name_1, "copy1/%s", resource_name);
-    sprintf(file_name_2, "copy2/%s", resource_name);
-    sprintf(file_name_3, "copy3/%s", resource_name);
-    
-    open_fd = open(file_name_1, O_RDONLY);
-    open_fd_2 = open(file_name_2, O_RDONLY);
-    open_fd_3 = open(file_name_3, O_RDONLY);
-       
-    // send appropriate response
-    if ((open_fd < 0 && open_fd_2 < 0) || (open_fd < 0 && open_fd_3 < 0) ||
-        (open_fd_2 < 0 && open_fd_3 < 0)) {
-        // named file does not exist, send 404 response
-        if (errno == ENOENT) {
-            send_response(comm_fd, 404, content_length, resource_name);
-            return -1;
-        }
-        // named file cannot be opened due to permissions
-        else if (errno == EACCES) {
-            send_response(comm_fd, 403, content_length, resource_name);
-            return -1;
+    // the buffer pool, blocks handed out of each class that has been used and how often a
+    // thread's own lists ran dry, and the connection slab
+    unsigned long allocs[NUM_BUFFER_CLASSES] = {0};
+    unsigned long refills = 0;
+    pthread_mutex_lock(&buffers.caches_mutex);
+    for (struct buffer_cache* cache = buffers.caches; cache != NULL; cache = cache->next) {
+        for (int c = 0; c < NUM_BUFFER_CLASSES; c++) {
+            allocs[c] += cache->allocs[c].load(memory_order_relaxed);
         }
-        else {
-            // send 500 response
-            send_response(comm_fd, 500, content_length, resource_name);
-            return -1;
+        refills += cache->refills.load(memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&buffers.caches_mutex);
+    for (int c = 0; c < NUM_BUFFER_CLASSES; c++) {
+        if (allocs[c] > 0) {
+            length += snprintf(body + length, sizeof(body) - length, "buffer_allocs_%d %lu\n", BUFFER_MIN_SIZE << c, allocs[c]);
         }
     }
     
-    int file_num = get_which_file(file_name_1, file_name_2, file_name_3);
+    struct slab* connections = &shared->timers.connections;
+    pthread_mutex_lock(&connections->mutex);
+    long connections_in_use = connections->in_use;
+    long connections_capacity = connections->capacity;
+    pthread_mutex_unlock(&connections->mutex);
+    length += snprintf(body + length, sizeof(body) - length,
+        "buffer_refills %lu\nbuffer_mapped_bytes %lu\nconnection_slab_in_use %ld\nconnection_slab_capacity %ld\n",
+        refills, buffers.mapped_bytes.load(), connections_in_use, connections_capacity);
     
-    // by default open_fd is already file 1
-    if (file_num == 2) {
-        open_fd = open_fd_2;
-    } else if (file_num < 0) {
-        send_response(comm_fd, 500, content_length, resource_name);
-        return -1;
+    send_response(comm_fd, 200, length, NULL);
+    return send_all(comm_fd, body, length);
+}
+
+// serves the one request waiting on a connection, returns -1 if the connection
+// should be closed afterwards
+task<int> serve_request(struct connection* conn, char comm_buffer[], struct shared_data* shared) {
+    int comm_fd = conn->fd;
+    struct io_context io = {comm_fd, conn, shared};
+    int n = recv_header(comm_fd, comm_buffer, conn);
+    if (n <= 0) {
+        co_return -1;
     }
+    set_phase(conn, PHASE_BODY);
     
-    int content_len = 0;
-    unsigned char* get_buffer = (unsigned char*) malloc(BUFFER_SIZE * sizeof(unsigned char));
-        
-    // Gets Content-Length before sending a response
-    int size = read(open_fd, get_buffer, BUFFER_SIZE);
+    // parse requests
+    struct header head = parseHeader(comm_buffer);
+    io.head = &head;
+    io.chunked = head.chunked;
     
-    while (size != 0) {
-        if (size < 0) {
-            send_response(comm_fd, 500, content_length, resource_name);
-            free(get_buffer);
-            return -1;
+    // a new member announcing itself to the cluster
+    if (shared->cluster != NULL && head.command != NULL && head.resource_name != NULL &&
+        strcmp(head.command, "JOIN") == 0) {
+        if (handle_join(comm_fd, head.resource_name, shared) < 0) {
+            co_return -1;
         }
-                            
-        content_len += size;
-        
-        size = read(open_fd, get_buffer, BUFFER_SIZE);
+        co_return 0;
     }
     
-    close(open_fd);
-    close(open_fd_2);
-    close(open_fd_3);
+    // the server's counters
+    if (head.command != NULL && head.resource_name != NULL && strcmp(head.command, "GET") == 0 &&
+        strcmp(head.resource_name, METRICS_PATH) == 0) {
+        co_return handle_metrics(comm_fd, shared);
+    }
     
-    if (file_num == 1) {
-        open_fd = open(file_name_1, O_RDONLY);
-    } else { // file_num == 2
-        open_fd = open(file_name_2, O_RDONLY);
+    // check if resource name is valid
+    // length must = 11 (including the '/')
+    if (strlen(head.resource_name) != 11) {
+        // send 400 response
+        send_response(comm_fd, 400, 0, head.resource_name);
+        co_return -1;
     }
     
-    // Tells client how many bytes to expect
-    send_response(comm_fd, 200, content_len, resource_name);
-
-    // Sends the data of size Content-Length
-    size = read(open_fd, get_buffer, BUFFER_SIZE);
+    // must contain alphanumeric characters
+    bool contains_other = false;
+    for (int i = 1; i < 11; i++) {
+        if (isalnum(head.resource_name[i]) == 0) {
+            // send 400 response
+            send_response(comm_fd, 400, 0, head.resource_name);
+            contains_other = true;
+            break;
+        }
+    }
     
-    while (size != 0) {
-        if (size < 0) {
-            send_response(comm_fd, 500, content_length, resource_name);
-            return -1;
+    if (contains_other) {
+        co_return -1;
+    }
+    
+    // in a cluster, keys owned by another member are passed on to it
+    struct peer* owner = NULL;
+    if (shared->cluster != NULL && !head.from_peer) {
+        int member = cluster_owner(shared->cluster, head.resource_name + 1, false);
+        if (member != shared->cluster->self) {
+            owner = cluster_member(shared->cluster, member);
         }
-                                    
-        int n = send(comm_fd, get_buffer, size, 0);
-        if (n == -1) {
-            return -1;
+    }
+                
+    // a body is sent with a Content-Length or in chunks, never both, and chunked is the only
+    // transfer coding taken
+    if (head.unknown_encoding || (head.chunked && head.content_length >= 0)) {
+        send_response(comm_fd, head.unknown_encoding ? 501 : 400, 0, head.resource_name);
+        co_return -1;
+    }
+    
+    // handle PUT/GET requests
+    if (strcmp(head.command, "PUT") == 0) {
+        // handlers strip the '/' in place
+        string file_name(head.resource_name + 1);
+        
+        // chunks are only taken apart by the coroutine stores, a PUT that's passed on or
+        // stored by a blocking handler needs a Content-Length or to end at EOF
+        if (head.chunked && (!shared->backends.empty() || owner != NULL || (!shared->peers.empty() && !head.from_peer) ||
+            shared->log != NULL || shared->erasure)) {
+            send_response(comm_fd, 501, 0, head.resource_name);
+            co_return -1;
+        }
+        
+        if (!shared->backends.empty()) {
+            n = handle_balance(comm_fd, comm_buffer, head.command, head.resource_name, head.content_length, shared, &head);
+        } else if (owner != NULL) {
+            n = handle_proxy(comm_fd, comm_buffer, head.command, head.resource_name, head.content_length, owner, &head);
+        } else if (head.handoff && shared->cluster != NULL && has_local_object(shared, head.resource_name + 1)) {
+            n = handle_stale_handoff(comm_fd, comm_buffer, head.resource_name, head.content_length);
+        } else if (!shared->peers.empty() && !head.from_peer) {
+            n = handle_put_peers(comm_fd, comm_buffer, head.resource_name, head.content_length, shared);
+        } else {
+            n = co_await put_handler(shared)(&io, comm_buffer, head.resource_name, head.content_length, shared);
+        }
+        
+        if (n < 0) {
+            co_return -1;
+        }
+        record_object_size(shared, file_name, head.content_length);
+        
+    } else if (strcmp(head.command, "GET") == 0) {
+        if (!shared->backends.empty()) {
+            n = handle_balance(comm_fd, comm_buffer, head.command, head.resource_name, head.content_length, shared, &head);
+        } else if (owner != NULL) {
+            n = handle_proxy(comm_fd, comm_buffer, head.command, head.resource_name, head.content_length, owner, &head);
+        } else if (shared->cluster != NULL && !head.from_peer) {
+            n = handle_get_cluster(comm_fd, comm_buffer, head.resource_name, head.content_length, shared, &head);
+        } else if (!shared->peers.empty() && !head.from_peer) {
+            n = handle_get_peers(comm_fd, comm_buffer, head.resource_name, head.content_length, shared, &head);
+        } else {
+            n = co_await get_handler(shared)(&io, comm_buffer, head.resource_name, head.content_length, shared);
+        }
+        
+        if (n < 0) {
+            co_return -1;
         }
         
-        size = read(open_fd, get_buffer, BUFFER_SIZE);
+    } else if (strcmp(head.command, "HEAD") == 0) {
+        // HEADs go where GETs would, a key that hasn't been handed over yet is looked up on
+        // its previous owner, but they aren't answered where a GET needs a quorum of peers
+        int previous = owner == NULL && shared->cluster != NULL && !head.from_peer &&
+            !has_local_object(shared, head.resource_name + 1) ? cluster_owner(shared->cluster, head.resource_name + 1, true) : -1;
+        if (!shared->backends.empty()) {
+            n = handle_balance(comm_fd, comm_buffer, head.command, head.resource_name, head.content_length, shared, &head);
+        } else if (owner != NULL) {
+            n = handle_proxy(comm_fd, comm_buffer, head.command, head.resource_name, head.content_length, owner, &head);
+        } else if (previous >= 0 && previous != shared->cluster->self) {
+            n = handle_proxy(comm_fd, comm_buffer, head.command, head.resource_name, head.content_length,
+                cluster_member(shared->cluster, previous), &head);
+        } else if (head_handler(shared) != NULL && (shared->peers.empty() || head.from_peer)) {
+            n = co_await head_handler(shared)(&io, comm_buffer, head.resource_name, head.content_length, shared);
+        } else {
+            // a well formed HEAD this server just can't answer
+            send_response(comm_fd, 501, 0, head.resource_name);
+            co_return -1;
+        }
+        
+        if (n < 0) {
+            co_return -1;
+        }
+        
+    } else {
+        // if invalid request type
+        send_response(comm_fd, 400, 0, head.resource_name);
+        co_return -1;
     }
-
-    close(open_fd);
-    free(get_buffer);
-    
-    pthread_mutex_unlock(&shared->file_mutex_map[file1]);
-    pthread_mutex_unlock(&shared->file_mutex_map[file2]);
-    pthread_mutex_unlock(&shared->file_mutex_map[file3]);
     
-    return 0;
+    co_return 0;
 }
 
-void* dispatcher(void* data) {
-    struct shared_data* shared = (struct shared_data*) data;
-    while (1) {
-        // gets communication fd
-        int comm_fd = accept(shared->listen_fd, NULL, NULL);
-
-        // locks queue mutex for safe access
-        pthread_mutex_lock(&shared->connections_queue_mutex);
-
-        // pushes new communication to queue
-        shared->connections_queue.push(comm_fd);
-        
-        // unlocks queue mutex so other threads can access
-        pthread_mutex_unlock(&shared->connections_queue_mutex);
-        
-        // send a signal for a worker thread
-        pthread_cond_signal(&shared->worker_cond);
+// serves one request, then the connection goes back to wait for its next one so a
+// client that keeps it open doesn't keep the worker too
+detached run_request(struct shared_data* shared, struct connection* conn) {
+    // buffer for communication channel, it outlives the call if a handler parks the request
+    char* comm_buffer = (char*) pool_alloc(BUFFER_SIZE);
+    int n = co_await serve_request(conn, comm_buffer, shared);
+    pool_free(comm_buffer, BUFFER_SIZE);
+    if (n < 0) {
+        close_connection(conn);
+    } else {
+        park_connection(shared, conn, EPOLL_CTL_MOD);
     }
 }
 
-void* worker(void* data) {
-    struct shared_data* shared = (struct shared_data*) data;
-    // buffer for communication channel
-    char comm_buffer[BUFFER_SIZE];
-    while (1) {
-        // locks queue mutex for safe access
-        pthread_mutex_lock(&shared->connections_queue_mutex);
+// serves the request a connection is ready with, or carries on with the one parked on it
+void serve_connection(struct shared_data* shared, struct connection* conn) {
+    if (conn->resume) {
+        coroutine_handle<> parked = conn->resume;
+        conn->resume = nullptr;
+        parked.resume();
+    } else {
+        run_request(shared, conn);
+    }
+}
 
-        // if the requests queue is empty, wait for signal from dispatch
-        while (shared->connections_queue.empty()) {
-            pthread_cond_wait(&shared->worker_cond, &shared->connections_queue_mutex);
+void serve_waiting(struct worker_data* self) {
+    self->slicing = false;
+    for (int i = 0; i < SLICE_REQUESTS; i++) {
+        struct connection* conn = take_ready(self->shared, self->index, CLASS_SMALL, true);
+        if (conn == NULL) {
+            break;
         }
+        serve_connection(self->shared, conn);
+    }
+    self->slicing = true;
+}
 
-        // pop from queue the comm_fd that this thread will be using
-        int comm_fd = shared->connections_queue.front();
-        shared->connections_queue.pop();
 
-        // printf("From thread with id %lu\n", pthread_self());
+// gives up a retiring worker's deque and takes anything pushed to it since it last looked,
+// called with idle_mutex held before the worker's slot is freed, so start_worker can't hand
+// the deque to a new worker until it is done with
+vector<struct connection*> drain_worker(struct shared_data* shared, struct worker_data* self) {
+    struct work_deque* d = shared->deques[self->index];
+    vector<struct connection*> left;
+    pthread_mutex_lock(&d->mutex);
+    d->active = false;
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        left.insert(left.end(), d->items[c].begin(), d->items[c].end());
+        d->items[c].clear();
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return left;
+}
+
+// passes on what drain_worker took from a retiring worker's deque, and frees the worker
+void stop_worker(struct shared_data* shared, struct worker_data* self, vector<struct connection*>& left) {
+    for (size_t i = 0; i < left.size(); i++) {
+        shared->ready_count--;
+        enqueue_ready(shared, left[i]);
+    }
+    release_thread_buffers();
+    delete self;
+}
 
-        // unlocks queue mutex
-        pthread_mutex_unlock(&shared->connections_queue_mutex);
+void* worker(void* data) {
+    struct worker_data* self = (struct worker_data*) data;
+    struct shared_data* shared = self->shared;
+    self->slicing = false;
+    current_worker = self;
+    while (1) {
+        struct connection* conn = take_ready(shared, self->index, NUM_CLASSES - 1, false);
         
-        // handles requests
-        while (1) {
-            int n = recv(comm_fd, comm_buffer, BUFFER_SIZE, 0);
-            if (n == 0) {
-                break;
-            }
-            comm_buffer[n] = '\0';
-            
-            // parse requests
-            struct header head = parseHeader(comm_buffer);
-            
-            // check if resource name is valid
-            // length must = 11 (including the '/')
-            if (strlen(head.resource_name) != 11) {
-                // send 400 response
-                send_response(comm_fd, 400, 0, head.resource_name);
-                break;
-            }
+        // if every deque is empty, wait for signal from dispatch, leaving the pool if
+        // there has been nothing to do for POOL_IDLE_SECONDS and it is above its minimum
+        if (conn == NULL) {
+            bool retire = false;
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += POOL_IDLE_SECONDS;
             
-            // must contain alphanumeric characters
-            bool contains_other = false;
-            for (int i = 1; i < 11; i++) {
-                if (isalnum(head.resource_name[i]) == 0) {
-                    // send 400 response
-                    send_response(comm_fd, 400, 0, head.resource_name);
-                    contains_other = true;
-                    break;
+            pthread_mutex_lock(&shared->idle_mutex);
+            shared->pool.idle++;
+            while (shared->ready_count == 0 && !retire) {
+                if (pthread_cond_timedwait(&shared->worker_cond, &shared->idle_mutex, &until) == ETIMEDOUT) {
+                    retire = shared->ready_count == 0 && shared->pool.size > shared->pool.min;
+                    until.tv_sec += POOL_IDLE_SECONDS;
                 }
             }
+            shared->pool.idle--;
+            vector<struct connection*> left;
+            if (retire) {
+                left = drain_worker(shared, self);
+                shared->pool.size--;
+                shared->pool.workers[self->index] = NULL;
+                shared->pool.shrunk++;
+                shared->pool.last_resize = "shrink_idle";
+            }
+            pthread_mutex_unlock(&shared->idle_mutex);
             
-            if (contains_other) {
-                break;
+            if (retire) {
+                stop_worker(shared, self, left);
+                return NULL;
             }
-                        
-            // handle PUT/GET requests
-            if (strcmp(head.command, "PUT") == 0) {
-                int n;
-                
-                if (!shared->redundancy) {
-                    n = handle_put(comm_fd, comm_buffer, head.resource_name, head.content_length, shared);
-                } else {
-                    n = handle_put_redundancy(comm_fd, comm_buffer, head.resource_name, head.content_length, shared);
-                }
-                
-                if (n < 0) {
-                    break;
-                }
-                
-            } else if (strcmp(head.command, "GET") == 0) {
-                int n;
-                
-                if (!shared->redundancy) {
-                    n = handle_get(comm_fd, comm_buffer, head.resource_name, head.content_length, shared);
-                } else {
-                    n = handle_get_redundancy(comm_fd, comm_buffer, head.resource_name, head.content_length, shared);
-                }
-                
-                if (n < 0) {
-                    break;
-                }
-                
-            } else {
-                // if invalid request type
-                send_response(comm_fd, 400, 0, head.resource_name);
-                break;
+            continue;
+        }
+        
+        // bulk requests are served in slices, with small requests let through in between
+        bool bulk = conn->priority == CLASS_BULK;
+        if (bulk) {
+            strcpy(self->sliced_name, conn->name);
+            pthread_mutex_lock(&shared->sliced_names_mutex);
+            shared->sliced_names.insert(self->sliced_name);
+            pthread_mutex_unlock(&shared->sliced_names_mutex);
+            self->slice_bytes = 0;
+            self->slicing = true;
+        }
+        
+        self->busy_since = now_us();
+        serve_connection(shared, conn);
+        uint64_t since = self->busy_since;
+        self->busy_since = 0;
+        self->busy_us += now_us() - since;
+        
+        if (bulk) {
+            self->slicing = false;
+            pthread_mutex_lock(&shared->sliced_names_mutex);
+            shared->sliced_names.erase(shared->sliced_names.find(self->sliced_name));
+            pthread_mutex_unlock(&shared->sliced_names_mutex);
+        }
+    }
+}
+
+// adds a worker to the pool on a free deque, called with idle_mutex held
+bool start_worker(struct shared_data* shared) {
+    struct worker_pool* pool = &shared->pool;
+    int index = find(pool->workers.begin(), pool->workers.end(), (struct worker_data*) NULL) - pool->workers.begin();
+    if (index == (int) pool->workers.size()) {
+        return false;
+    }
+    
+    struct worker_data* w = new struct worker_data;
+    w->shared = shared;
+    w->index = index;
+    w->busy_us = 0;
+    w->busy_since = 0;
+    w->last_busy_us = 0;
+    w->last_cpu_us = 0;
+    
+    struct work_deque* d = shared->deques[index];
+    pthread_mutex_lock(&d->mutex);
+    d->active = true;
+    pthread_mutex_unlock(&d->mutex);
+    
+    // a pinned worker starts on its CPU, so its stack is on that CPU's node too
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (!pool->cpus.empty()) {
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(pool->cpus[index % pool->cpus.size()], &cpu);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+    }
+    
+    pthread_t thread;
+    int created = pthread_create(&thread, &attr, &worker, w);
+    pthread_attr_destroy(&attr);
+    if (created != 0) {
+        pthread_mutex_lock(&d->mutex);
+        d->active = false;
+        pthread_mutex_unlock(&d->mutex);
+        delete w;
+        return false;
+    }
+    pthread_detach(thread);
+    pthread_getcpuclockid(thread, &w->cpu_clock);
+    pool->workers[index] = w;
+    pool->size++;
+    return true;
+}
+
+// grows the pool when requests wait in the deques, or when every worker is busy and
+// spends most of that time blocked rather than on the CPU, workers that stay idle
+// shrink it themselves
+void* pool_manager(void* data) {
+    struct shared_data* shared = (struct shared_data*) data;
+    struct worker_pool* pool = &shared->pool;
+    while (1) {
+        usleep(POOL_INTERVAL_MS * 1000);
+        
+        uint64_t waited = pool->waited.exchange(0);
+        uint64_t wait_us = pool->wait_us.exchange(0);
+        uint64_t average_wait = waited == 0 ? 0 : wait_us / waited;
+        
+        uint64_t now = now_us();
+        uint64_t busy_total = 0;
+        uint64_t cpu_total = 0;
+        pthread_mutex_lock(&shared->idle_mutex);
+        for (size_t i = 0; i < pool->workers.size(); i++) {
+            struct worker_data* w = pool->workers[i];
+            if (w == NULL) {
+                continue;
             }
+            // counts the request being served so far too
+            uint64_t since = w->busy_since;
+            uint64_t busy = w->busy_us + (since != 0 && now > since ? now - since : 0);
+            struct timespec cpu;
+            clock_gettime(w->cpu_clock, &cpu);
+            uint64_t cpu_us = (uint64_t) cpu.tv_sec * 1000000 + cpu.tv_nsec / 1000;
             
+            // a request that ended while being read can be counted twice, the next
+            // look makes up for it
+            if (busy > w->last_busy_us) {
+                busy_total += busy - w->last_busy_us;
+                w->last_busy_us = busy;
+            }
+            cpu_total += cpu_us - w->last_cpu_us;
+            w->last_cpu_us = cpu_us;
+        }
+        int blocked = busy_total > cpu_total ? (busy_total - cpu_total) * 100 / busy_total : 0;
+        pool->last_wait_us = average_wait;
+        pool->last_blocked_percent = blocked;
+        
+        if (pool->size < pool->max) {
+            const char* reason = NULL;
+            if (average_wait >= POOL_GROW_WAIT_US) {
+                reason = "grow_queue_wait";
+            } else if (pool->idle == 0 && shared->ready_count > 0 && blocked >= POOL_GROW_BLOCKED_PERCENT) {
+                reason = "grow_blocked";
+            }
+            if (reason != NULL && start_worker(shared)) {
+                pool->grown++;
+                pool->last_resize = reason;
+            }
         }
+        pthread_mutex_unlock(&shared->idle_mutex);
+    }
+}
 
+// parses a list of CPUs such as "0-3,8" into cpus, returns false if it isn't one or
+// names a CPU this machine doesn't have
+bool parse_cpu_list(const char* list, vector<int>& cpus) {
+    int num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    const char* p = list;
+    while (*p != '\0') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            return false;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return false;
+            }
+        }
+        if (first < 0 || last < first || last >= num_cpus) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+        
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return false;
+        }
+        p = end;
     }
+    return !cpus.empty();
 }
 
 int main(int argc, char* argv[]) {
@@ -726,8 +5532,25 @@ int main(int argc, char* argv[]) {
     // process command line args
     // ======================================================================
     unsigned short port_number;
-    unsigned short num_threads = 4;
+    int min_threads = 4;
+    int max_threads = 4;
+    vector<int> worker_cpus;
+    vector<int> dispatcher_cpus;
     bool flag_redundancy = false;
+    bool flag_erasure = false;
+    bool flag_log = false;
+    bool flag_sharded = false;
+    vector<string> replica_roots;
+    int write_quorum = 0;
+    int read_quorum = 0;
+    vector<struct peer*> peers;
+    int peer_quorum = 0;
+    bool flag_cluster = false;
+    vector<string> cluster_seeds;
+    vector<struct backend*> backends;
+    int balance_policy = BALANCE_LEAST_OUTSTANDING;
+    int timeouts[NUM_PHASES] = {DEFAULT_IDLE_TIMEOUT, DEFAULT_HEADER_TIMEOUT, DEFAULT_BODY_TIMEOUT};
+    long direct_put_size = 0;
     char* address;
     extern char *optarg;
     extern int optind, optopt;
@@ -743,21 +5566,147 @@ int main(int argc, char* argv[]) {
         port_number = 80;
     }
     else if (argc < 2){
-        fprintf(stderr, "Usage: %s <address> [port number] [-r] [-N=<num_threads>]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <address> [port number] [-r] [-e] [-L] [-S] [-d <replica root>] [-W <write quorum>] [-R <read quorum>] [-P <host:port>] [-Q <peer quorum>] [-C] [-K <host:port>] [-B <host:port>] [-b least|p2c] [-T <header:body:idle seconds>] [-A <worker cpus>] [-a <dispatcher cpus>] [-D <direct PUT MiB>] [-N=<num_threads>[:<max threads>]]\n", argv[0]);
         exit(1);
     }
     
-    // parses command line options -r and -N
-    while ((c = getopt(argc, argv, "rN:")) != -1) {
+    // parses command line options -r, -e, -L, -S, -d, -W, -R, -P, -Q, -C, -K, -B, -b, -T, -A, -a, -D and -N
+    while ((c = getopt(argc, argv, "reLSd:W:R:P:Q:CK:B:b:T:A:a:D:N:")) != -1) {
         switch (c) {
             case 'r':
                 flag_redundancy = true;
                 break;
+            case 'e':
+                // erasure coding is a kind of redundancy, it uses the same replica roots
+                flag_redundancy = true;
+                flag_erasure = true;
+                break;
+            case 'L':
+                flag_log = true;
+                break;
+            case 'S':
+                flag_sharded = true;
+                break;
+            case 'd':
+                // each -d adds a replica root, they can be on different mount points
+                if (strlen(optarg) > MAX_ROOT_LENGTH) {
+                    fprintf(stderr, "Replica root %s is too long\n", optarg);
+                    exit(1);
+                }
+                replica_roots.push_back(optarg);
+                break;
+            case 'W':
+                write_quorum = atoi(optarg);
+                break;
+            case 'R':
+                read_quorum = atoi(optarg);
+                break;
+            case 'P': {
+                // each -P adds a peer server that PUTs are replicated to
+                char* colon = strrchr(optarg, ':');
+                if (colon == NULL) {
+                    fprintf(stderr, "Peer %s must be given as host:port\n", optarg);
+                    exit(1);
+                }
+                *colon = '\0';
+                struct peer* p = new struct peer;
+                memset(&p->addr, 0, sizeof(p->addr));
+                p->addr.sin_family = AF_INET;
+                p->addr.sin_port = htons(atoi(colon + 1));
+                p->addr.sin_addr.s_addr = getaddr(optarg);
+                pthread_mutex_init(&p->mutex, NULL);
+                peers.push_back(p);
+                break;
+            }
+            case 'Q':
+                peer_quorum = atoi(optarg);
+                break;
+            case 'C':
+                flag_cluster = true;
+                break;
+            case 'K': {
+                // each -K names a member of the cluster to join
+                char* colon = strrchr(optarg, ':');
+                if (colon == NULL) {
+                    fprintf(stderr, "Cluster member %s must be given as host:port\n", optarg);
+                    exit(1);
+                }
+                *colon = '\0';
+                struct in_addr member_addr;
+                member_addr.s_addr = getaddr(optarg);
+                char member_id[50];
+                snprintf(member_id, 50, "%s:%d", inet_ntoa(member_addr), atoi(colon + 1));
+                cluster_seeds.push_back(member_id);
+                flag_cluster = true;
+                break;
+            }
+            case 'B': {
+                // each -B adds a backend server, requests are spread over them
+                struct backend* b = new struct backend;
+                b->id = optarg;
+                char* colon = strrchr(optarg, ':');
+                if (colon == NULL) {
+                    fprintf(stderr, "Backend %s must be given as host:port\n", optarg);
+                    exit(1);
+                }
+                *colon = '\0';
+                memset(&b->conn.addr, 0, sizeof(b->conn.addr));
+                b->conn.addr.sin_family = AF_INET;
+                b->conn.addr.sin_port = htons(atoi(colon + 1));
+                b->conn.addr.sin_addr.s_addr = getaddr(optarg);
+                pthread_mutex_init(&b->conn.mutex, NULL);
+                b->outstanding = 0;
+                b->failures = 0;
+                b->healthy = true;
+                b->ejected_at = 0;
+                backends.push_back(b);
+                break;
+            }
+            case 'b':
+                if (strcmp(optarg, "least") == 0) {
+                    balance_policy = BALANCE_LEAST_OUTSTANDING;
+                } else if (strcmp(optarg, "p2c") == 0) {
+                    balance_policy = BALANCE_TWO_CHOICES;
+                } else {
+                    fprintf(stderr, "-b must be least or p2c\n");
+                    exit(1);
+                }
+                break;
+            case 'T':
+                // 0 turns a timeout off
+                if (sscanf(optarg, "%d:%d:%d", &timeouts[PHASE_HEADER], &timeouts[PHASE_BODY], &timeouts[PHASE_IDLE]) != 3 ||
+                    timeouts[PHASE_HEADER] < 0 || timeouts[PHASE_BODY] < 0 || timeouts[PHASE_IDLE] < 0) {
+                    fprintf(stderr, "-T must be header:body:idle timeouts in seconds\n");
+                    exit(1);
+                }
+                break;
+            case 'A':
+                if (!parse_cpu_list(optarg, worker_cpus)) {
+                    fprintf(stderr, "-A must be a list of CPUs such as 0-3,8\n");
+                    exit(1);
+                }
+                break;
+            case 'a':
+                if (!parse_cpu_list(optarg, dispatcher_cpus)) {
+                    fprintf(stderr, "-a must be a list of CPUs such as 0-3,8\n");
+                    exit(1);
+                }
+                break;
+            case 'D':
+                direct_put_size = atol(optarg) << 20;
+                if (direct_put_size <= 0) {
+                    fprintf(stderr, "-D must be a positive number of MiB\n");
+                    exit(1);
+                }
+                break;
             case 'N':
-                num_threads = atoi(optarg);
+                // -N min:max lets the pool grow and shrink between the two
+                if (sscanf(optarg[0] == '=' ? optarg + 1 : optarg, "%d:%d", &min_threads, &max_threads) == 1) {
+                    max_threads = min_threads;
+                }
                 break;
             default:
-                fprintf(stderr, "Usage: %s <address> [port number] [-r] [-N=<num_threads>]\n", argv[0]);
+                fprintf(stderr, "Usage: %s <address> [port number] [-r] [-e] [-L] [-S] [-d <replica root>] [-W <write quorum>] [-R <read quorum>] [-P <host:port>] [-Q <peer quorum>] [-C] [-K <host:port>] [-B <host:port>] [-b least|p2c] [-T <header:body:idle seconds>] [-A <worker cpus>] [-a <dispatcher cpus>] [-D <direct PUT MiB>] [-N=<num_threads>[:<max threads>]]\n", argv[0]);
                 exit(1);
         }
     }
@@ -765,6 +5714,71 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "Expected argument after options\n");
         exit(1);
     }
+    if (flag_log && flag_redundancy) {
+        fprintf(stderr, "-L can't be combined with -r\n");
+        exit(1);
+    }
+    if (flag_log && flag_sharded) {
+        fprintf(stderr, "-L can't be combined with -S\n");
+        exit(1);
+    }
+    if (!backends.empty() && (flag_redundancy || flag_log || flag_sharded || flag_cluster || !peers.empty())) {
+        fprintf(stderr, "-B doesn't store anything itself, so it can't be combined with -r, -e, -L, -S, -P or -C\n");
+        exit(1);
+    }
+    if (flag_cluster && (flag_log || !peers.empty())) {
+        fprintf(stderr, "-C can't be combined with -L or -P\n");
+        exit(1);
+    }
+    if (!flag_redundancy && (!replica_roots.empty() || write_quorum != 0 || read_quorum != 0)) {
+        fprintf(stderr, "-d, -W and -R need -r\n");
+        exit(1);
+    }
+    
+    // a PUT is acknowledged by a majority of the local store and the peers by default
+    if (peers.empty() && peer_quorum != 0) {
+        fprintf(stderr, "-Q needs -P\n");
+        exit(1);
+    }
+    if (peer_quorum == 0) {
+        peer_quorum = (peers.size() + 1) / 2 + 1;
+    }
+    if (!peers.empty() && (peer_quorum < 1 || peer_quorum > (int) peers.size() + 1)) {
+        fprintf(stderr, "-Q must be between 1 and the number of peers plus one (%d)\n", (int) peers.size() + 1);
+        exit(1);
+    }
+    
+    // replicas go to copy[1-3] unless the roots are given, and both quorums
+    // default to a majority of the replicas
+    if (flag_redundancy) {
+        if (replica_roots.empty()) {
+            for (int i = 1; i <= DEFAULT_REPLICAS; i++) {
+                char root[10];
+                snprintf(root, 10, "copy%d", i);
+                replica_roots.push_back(root);
+            }
+        }
+        int num_replicas = replica_roots.size();
+        if (flag_erasure && num_replicas != EC_SHARDS) {
+            fprintf(stderr, "-e needs exactly %d replica roots\n", EC_SHARDS);
+            exit(1);
+        }
+        if (write_quorum == 0) {
+            write_quorum = num_replicas / 2 + 1;
+        }
+        if (read_quorum == 0) {
+            read_quorum = num_replicas / 2 + 1;
+        }
+        if (write_quorum < 1 || write_quorum > num_replicas || read_quorum < 1 || read_quorum > num_replicas) {
+            fprintf(stderr, "Quorums must be between 1 and the number of replicas (%d)\n", num_replicas);
+            exit(1);
+        }
+    }
+
+    if (min_threads < 1 || max_threads < min_threads) {
+        fprintf(stderr, "-N needs at least 1 thread, and a maximum no smaller than the minimum\n");
+        exit(1);
+    }
 
     // printf("address: %s, port: %d, -r: %d, -N: %d\n", address, port_number, flag_redundancy, num_threads);
     
@@ -799,120 +5813,223 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
     
-    // initializes file_mutex_map by adding files that already exist in the server
-    DIR *dir;
-    struct dirent *ent;
-    unordered_set<string> exclude_files;
-    exclude_files.insert("httpserver");
-    exclude_files.insert("httpserver.cpp");
-    exclude_files.insert("httpserver.o");
-    exclude_files.insert("Makefile");
-    exclude_files.insert("DESIGN.pdf");
-    exclude_files.insert("README.md");
-    
-    unordered_set<string> copy_dirs;
-    copy_dirs.insert("copy1");
-    copy_dirs.insert("copy2");
-    copy_dirs.insert("copy3");
-    
-    unordered_map<string, pthread_mutex_t> file_mutex_map;
-
-    bool copy_dirs_exist = false;
-    dir = opendir("./");
-    if (dir != NULL){
-        while ((ent = readdir(dir))){
-            // get file name
-            string file_name = ent->d_name;
-
-            // check if file_name isnt a assignemnt file
-            if (!exclude_files.count(file_name) && file_name[0] != '.') {
-
-                // if copy1, copy2, copy3 already exist, we need mutexes for files in them
-                if (copy_dirs.count(file_name) && flag_redundancy) {
-                    copy_dirs_exist = true;
-                    string path = "./" + file_name + "/";
-                    DIR * copy_dir = opendir(path.c_str());
-                    struct dirent *copy_ent;
-                    if (copy_dir != NULL) {
-                        while ((copy_ent = readdir(copy_dir))) {
-                            string copy_file_name = copy_ent->d_name;
-                            if (copy_file_name[0] != '.') {
-                                string temp_path = path + copy_file_name;
-                                temp_path.erase(0, 2);
-                                pthread_mutex_t file_mutex;
-                                pthread_mutex_init(&file_mutex, NULL);
-                                file_mutex_map[temp_path] = file_mutex;
-                                // printf("In copy: %s\n", temp_path.c_str());
-                            }
-                        }
-                    }
-                    else {
-                        fprintf(stderr, "Error opening copy directories: %d\n", errno);
-                    }
-                    closedir(copy_dir);
-                } 
-                else if (!copy_dirs.count(file_name) && !flag_redundancy) { // skip copy[1-3] when redundancy is not active
-                    pthread_mutex_t file_mutex;
-                    pthread_mutex_init(&file_mutex, NULL);
-                    file_mutex_map[file_name] = file_mutex;
-                    // printf("In cwd: %s\n", file_name.c_str());
-                }
-            }
-        }
+    // initializes known_files with the files that already exist in the server, from the
+    // manifest if the last shutdown was clean and otherwise by scanning for them
+    unordered_set<string> known_files;
+    if (!flag_log && !load_manifest(replica_roots, flag_sharded, known_files)) {
+        scan_files(replica_roots, flag_sharded, known_files);
     }
-    else {
-        fprintf(stderr, "Error opening directory: %d\n", errno);
-    }
-    closedir(dir);
 
-    // creates copy[1-3] dirs when there is a -r
-    if (flag_redundancy and !copy_dirs_exist){
-        mkdir("copy1", 0777);
-        mkdir("copy2", 0777);
-        mkdir("copy3", 0777);
+    // creates the replica roots when there is a -r
+    for (size_t i = 0; i < replica_roots.size(); i++) {
+        mkdir(replica_roots[i].c_str(), 0777);
     }
 
-    // print file mutex map
-    // for (auto it = file_mutex_map.cbegin(); it != file_mutex_map.cend(); ++it) {
-    //     printf("In file mutex map: %s\n", (*it).first.c_str());
-    // }
-
     // ======================================================================
     // Create threads
     // ======================================================================
 
     // dispatch thread
     pthread_t dispatch_thread;
-    // vector for N worker threads
-    vector<pthread_t> worker_threads(num_threads);
 
     // initialize shared data
     struct shared_data common_data;
     // initialize condition variables
     pthread_cond_init(&common_data.worker_cond, NULL);
-    // queue for requests
-    queue<int> connections_queue;
-    common_data.connections_queue = connections_queue;
-    // mutex for queue access
-    pthread_mutex_init(&common_data.connections_queue_mutex, NULL);
+    pthread_mutex_init(&common_data.idle_mutex, NULL);
     // socket fd
     common_data.listen_fd = listen_fd;
+    
+    // connections wait in the epoll set between requests, the listening socket is
+    // told apart by having no connection
+    common_data.epoll_fd = epoll_create1(0);
+    struct epoll_event listen_event;
+    listen_event.events = EPOLLIN;
+    listen_event.data.ptr = NULL;
+    if (common_data.epoll_fd < 0 || epoll_ctl(common_data.epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) < 0) {
+        warn("%s\n", argv[0]);
+        exit(1);
+    }
+    
+    // a deque of ready connections for each worker the pool can grow to
+    for (int i = 0; i < max_threads; i++) {
+        struct work_deque* d = new struct work_deque;
+        pthread_mutex_init(&d->mutex, NULL);
+        d->active = false;
+        common_data.deques.push_back(d);
+    }
+    common_data.ready_count = 0;
+    common_data.next_deque = 0;
+    pthread_mutex_init(&common_data.object_sizes_mutex, NULL);
+    pthread_mutex_init(&common_data.sliced_names_mutex, NULL);
+
+    // files that exist, their mutexes are created as they get used
+    common_data.known_files.swap(known_files);
+    pthread_mutex_init(&common_data.file_mutex_map_mutex, NULL);
+
+    // SIGINT and SIGTERM are only handled by the shutdown thread, so every
+    // thread created after this point blocks them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    // a client or peer that hangs up mid response shows up as a failed send instead
+    signal(SIGPIPE, SIG_IGN);
+
+    // opens the log structured store and starts its compaction thread
+    common_data.log = NULL;
+    if (flag_log) {
+        common_data.log = new struct log_store;
+        if (log_open(common_data.log) < 0) {
+            fprintf(stderr, "Error opening log directory: %d\n", errno);
+            return 1;
+        }
+        
+        pthread_t compact_thread;
+        pthread_create(&compact_thread, NULL, &compactor, common_data.log);
+    }
 
-    // maps file names to their respective mutex
-    common_data.file_mutex_map = file_mutex_map;
+    // buffers and coroutine frames of the requests
+    init_buffer_pool();
+    
+    // times out stalled and idle connections
+    pthread_mutex_init(&common_data.timers.mutex, NULL);
+    slab_init(&common_data.timers.connections, sizeof(struct connection));
+    common_data.timers.now = 0;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        common_data.timers.timeouts[i] = (uint64_t) timeouts[i] * 1000 / TIMER_TICK_MS;
+        common_data.timers.reaped[i] = 0;
+    }
+    pthread_t reap_thread;
+    pthread_create(&reap_thread, NULL, &reaper, &common_data.timers);
 
-    // create main dispatcher thread
-    pthread_create(&dispatch_thread, NULL, &dispatcher, &common_data);
 
     common_data.redundancy = flag_redundancy;
+    common_data.erasure = flag_erasure;
+    common_data.replica_roots = replica_roots;
+    common_data.write_quorum = write_quorum;
+    common_data.read_quorum = read_quorum;
+    common_data.peers = peers;
+    common_data.peer_quorum = peer_quorum;
+    
+    // front-end mode passes every request on to the backends
+    common_data.backends = backends;
+    common_data.balance_policy = balance_policy;
+    common_data.next_backend = 0;
+    if (!backends.empty()) {
+        pthread_t check_thread;
+        pthread_create(&check_thread, NULL, &health_checker, &common_data);
+    }
+    
+    // puts this node and the members it was told about on the ring, members are
+    // identified by the address and port they listen on
+    common_data.cluster = NULL;
+    if (flag_cluster) {
+        if (myaddr.sin_addr.s_addr == htonl(INADDR_ANY)) {
+            fprintf(stderr, "-C needs the address the other members reach this server on\n");
+            return 1;
+        }
+        struct cluster* cluster = new struct cluster;
+        pthread_rwlock_init(&cluster->rwlock, NULL);
+        pthread_mutex_init(&cluster->rebalance_mutex, NULL);
+        pthread_cond_init(&cluster->rebalance_cond, NULL);
+        cluster->rebalance_needed = false;
+        cluster->keys_moved = 0;
+        
+        char self_id[50];
+        snprintf(self_id, 50, "%s:%d", inet_ntoa(myaddr.sin_addr), port_number);
+        cluster_add_member(cluster, self_id);
+        cluster->self = 0;
+        for (size_t i = 0; i < cluster_seeds.size(); i++) {
+            cluster_add_member(cluster, cluster_seeds[i]);
+        }
+        common_data.cluster = cluster;
+    }
+    
+    // rewrites divergent replicas found by GETs in the background
+    pthread_mutex_init(&common_data.repair_mutex, NULL);
+    pthread_cond_init(&common_data.repair_cond, NULL);
+    common_data.divergences_detected = 0;
+    common_data.divergences_repaired = 0;
+    if (flag_redundancy && !flag_erasure) {
+        pthread_t repair_thread;
+        pthread_create(&repair_thread, NULL, &repairer, &common_data);
+    }
     
-    // create N worker threads
-    for (int i = 0; i < num_threads; i++) {
-        if (pthread_create(&worker_threads[i], NULL, &worker, &common_data) < 0) {
+    // moves any files still in the flat layout over in the background
+    common_data.sharded = flag_sharded;
+    common_data.direct_put_size = direct_put_size;
+    common_data.migrating = flag_sharded;
+    if (flag_sharded) {
+        pthread_t migrate_thread;
+        pthread_create(&migrate_thread, NULL, &migrator, &common_data);
+    }
+    
+    // create the minimum number of worker threads, the pool manager adds more up to the
+    // maximum when they are needed
+    struct worker_pool* pool = &common_data.pool;
+    pool->min = min_threads;
+    pool->max = max_threads;
+    pool->size = 0;
+    pool->idle = 0;
+    pool->workers.assign(max_threads, NULL);
+    pool->wait_us = 0;
+    pool->waited = 0;
+    pool->last_wait_us = 0;
+    pool->last_blocked_percent = 0;
+    pool->grown = 0;
+    pool->shrunk = 0;
+    pool->last_resize = "none";
+    pool->cpus = worker_cpus;
+    for (int i = 0; i < max_threads && !worker_cpus.empty(); i++) {
+        int cpu = worker_cpus[i % worker_cpus.size()];
+        if (cpu >= (int) pool->cpu_deques.size()) {
+            pool->cpu_deques.resize(cpu + 1);
+        }
+        pool->cpu_deques[cpu].push_back(i);
+    }
+    pthread_mutex_lock(&common_data.idle_mutex);
+    for (int i = 0; i < min_threads; i++) {
+        if (!start_worker(&common_data)) {
             fprintf(stderr, "Error creating thread\n");
             return 1;
         }
     }
+    pthread_mutex_unlock(&common_data.idle_mutex);
+    if (max_threads > min_threads) {
+        pthread_t pool_thread;
+        pthread_create(&pool_thread, NULL, &pool_manager, &common_data);
+    }
+    
+    // create main dispatcher thread once there are workers to hand connections to, on
+    // the CPUs given with -a
+    pthread_attr_t dispatch_attr;
+    pthread_attr_init(&dispatch_attr);
+    if (!dispatcher_cpus.empty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (size_t i = 0; i < dispatcher_cpus.size(); i++) {
+            CPU_SET(dispatcher_cpus[i], &cpus);
+        }
+        pthread_attr_setaffinity_np(&dispatch_attr, sizeof(cpus), &cpus);
+    }
+    if (pthread_create(&dispatch_thread, &dispatch_attr, &dispatcher, &common_data) != 0) {
+        fprintf(stderr, "Error creating thread\n");
+        return 1;
+    }
+    pthread_attr_destroy(&dispatch_attr);
+    
+    pthread_t shutdown_thread;
+    pthread_create(&shutdown_thread, NULL, &shutdown_handler, &common_data);
+    
+    // joins the cluster once this node can serve the keys it will be given
+    if (flag_cluster) {
+        pthread_t rebalance_thread;
+        pthread_create(&rebalance_thread, NULL, &rebalancer, &common_data);
+        pthread_t join_thread;
+        pthread_create(&join_thread, NULL, &joiner, &common_data);
+    }
     
     // ** Need to use join because a new thread was created for dispatcher **
     pthread_join(dispatch_thread, NULL);
@@ -1,6 +1,10 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <string.h>
@@ -14,15 +18,85 @@
 #include <ctype.h>
 #include <time.h>
 #include <dirent.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <vector>
+#include <algorithm>
+#include <string>
 
 #define BUFFER_SIZE 16384
 
+// objects are served out of DATA_DIR, recovery builds the new root in STAGING_DIR
+// and then atomically swaps the two directories
+#define DATA_DIR "data"
+#define STAGING_DIR "data.staging"
+
 using namespace std;
 
+// sorted timestamps of every backup-[timestamp] dir, built on startup and kept
+// up to date by handle_backup so /l and /r don't have to scan the directory
+vector<long> backup_index;
+
+// -a: store each backup as one packed archive file instead of a directory
+bool archive_backups = false;
+
+// -z: compress each object in the backup archive (implies -a)
+bool compress_backups = false;
+
+// requests are served one at a time, so their handlers share one cache line aligned
+// buffer instead of each allocating its own
+alignas(64) unsigned char io_buffer[BUFFER_SIZE];
+
+// a packed backup archive holds the object data back to back, followed by a
+// sorted array of archive_entry and then an archive_footer at the end of the file,
+// the array starts at a multiple of alignof(struct archive_entry) so it can be read in place
+#define ARCHIVE_MAGIC "HTTPARC1"
+
+// codec an archive entry's data is stored with
+#define CODEC_NONE 0
+#define CODEC_DEFLATE 1
+
+// starting value of an entry's FNV-1a digest
+#define DIGEST_SEED 2166136261u
+
+// objects are compressed in batches of about this many bytes, one thread per core
+#define COMPRESS_BATCH_SIZE (64 << 20)
+
+// objects at least this big are deflated straight into the archive instead of into memory
+#define COMPRESS_STREAM_SIZE (16 << 20)
+
+struct archive_entry {
+    char name[16];
+    // offset and length of the stored (possibly compressed) data
+    uint64_t offset;
+    uint64_t length;
+    // length of the original object, and digest of the original data
+    uint64_t raw_length;
+    uint32_t digest;
+    uint32_t codec;
+};
+
+struct archive_footer {
+    char magic[8];
+    uint64_t index_offset;
+    uint64_t num_entries;
+};
+
+// an archive that has been mmap'd for reading
+struct archive {
+    int fd;
+    char* map;
+    size_t map_size;
+    uint64_t index_offset;
+    struct archive_entry* entries;
+    uint64_t num_entries;
+};
+
 struct header {
     char* command;
     char* resource_name;
-    int content_length;
+    long content_length;
 };
 
 struct header parseHeader(char buf[]) {
@@ -45,7 +119,7 @@ struct header parseHeader(char buf[]) {
         if (strstr(token, "Content-Length") != NULL) {
             token = strtok(NULL, " ");
             char *p = token;
-            long len;
+            long len = -1;
             while (isdigit(*p) && *p != '\\') {
                 len = strtol(p, &p, 10);
             }
@@ -56,12 +130,12 @@ struct header parseHeader(char buf[]) {
     return head;
 }
 
-int send_response(int comm_fd, int response_num, int content_len, char* resource_name) {
+int send_response(int comm_fd, int response_num, long content_len, char* resource_name) {
     char response_1[200];
     const char* response_2;
     
     if (response_num == 400) {
-        int k = snprintf(response_1, 200, "HTTP/1.1 400 Bad Request\r\nContent-Length: %d\r\n\r\n", content_len);
+        int k = snprintf(response_1, 200, "HTTP/1.1 400 Bad Request\r\nContent-Length: %ld\r\n\r\n", content_len);
         response_1[k] = '\0';
         send(comm_fd, response_1, strlen(response_1), 0);
         
@@ -81,7 +155,7 @@ int send_response(int comm_fd, int response_num, int content_len, char* resource
         warn("500 Internal Server Error While Opening %s For WRITE\n", resource_name);
         
     } else if (response_num == 200) {
-        int k = snprintf(response_1, 200, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", content_len);
+        int k = snprintf(response_1, 200, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n", content_len);
         response_1[k] = '\0';
         send(comm_fd, response_1, strlen(response_1), 0);
         
@@ -93,16 +167,696 @@ int send_response(int comm_fd, int response_num, int content_len, char* resource
     return 0;
 }
 
-int handle_put(int comm_fd, char buf[], char* resource_name, int content_length) {
+// returns true if name is a 10 character alphanumeric object name
+bool is_valid_name(const char* name) {
+    if (strlen(name) != 10) {
+        return false;
+    }
+    
+    for (int i = 0; i < 10; i++) {
+        if (!isalnum(name[i])) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// removes a flat directory and all the files inside of it
+int remove_tree(const char* dir_name) {
+    DIR *directory = opendir(dir_name);
+    if (directory == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    
+    struct dirent *file;
+    while ((file = readdir(directory))) {
+        if (strcmp(file->d_name, ".") == 0 || strcmp(file->d_name, "..") == 0) {
+            continue;
+        }
+        unlinkat(dirfd(directory), file->d_name, 0);
+    }
+    closedir(directory);
+    
+    return rmdir(dir_name);
+}
+
+// writes all len bytes of data to fd
+int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// copies src_name into dst_name with its permissions, as a reflink that shares the data
+// until either file is written where the file system supports it, otherwise byte by byte
+int copy_file(const char* src_name, const char* dst_name) {
+    int src_fd = open(src_name, O_RDONLY);
+    if (src_fd < 0) {
+        return -1;
+    }
+    
+    struct stat st;
+    int dst_fd = fstat(src_fd, &st) < 0 ? -1 : open(dst_name, O_RDWR | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    if (dst_fd < 0) {
+        close(src_fd);
+        return -1;
+    }
+    
+    int size = 0;
+    if (ioctl(dst_fd, FICLONE, src_fd) < 0) {
+        char copy_buffer[BUFFER_SIZE];
+        size = read(src_fd, copy_buffer, BUFFER_SIZE);
+        while (size > 0) {
+            if (write_all(dst_fd, copy_buffer, size) < 0) {
+                size = -1;
+                break;
+            }
+            size = read(src_fd, copy_buffer, BUFFER_SIZE);
+        }
+    }
+    // the umask doesn't get a say, the copy has the backup's permissions
+    if (fchmod(dst_fd, st.st_mode & 07777) < 0) {
+        size = -1;
+    }
+    
+    close(src_fd);
+    close(dst_fd);
+    
+    return size < 0 ? -1 : 0;
+}
+
+// fills STAGING_DIR with copies of every object in the backup directory, they're separate
+// files so a chmod or write of a live object never reaches the backup, and reflinks where
+// the file system allows so no file data is copied to build the new root
+int clone_backup(const char* backup_dir) {
+    remove_tree(STAGING_DIR);
+    if (mkdir(STAGING_DIR, 0777) < 0) {
+        return -1;
+    }
+    
+    DIR *directory = opendir(backup_dir);
+    if (directory == NULL) {
+        return -1;
+    }
+    
+    struct dirent *file;
+    while ((file = readdir(directory))) {
+        char* filename = file->d_name;
+        if (!is_valid_name(filename)) {
+            continue;
+        }
+        
+        char backup_filename[500];
+        char staging_filename[500];
+        snprintf(backup_filename, 500, "%s/%s", backup_dir, filename);
+        snprintf(staging_filename, 500, "%s/%s", STAGING_DIR, filename);
+        
+        if (copy_file(backup_filename, staging_filename) < 0) {
+            closedir(directory);
+            remove_tree(STAGING_DIR);
+            return -1;
+        }
+    }
+    closedir(directory);
+    
+    return 0;
+}
+
+// 32 bit FNV-1a hash, used as the per object digest in archives
+uint32_t fnv1a(uint32_t hash, const unsigned char* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+int compare_archive_entries(const void* a, const void* b) {
+    return strncmp(((const struct archive_entry*) a)->name, ((const struct archive_entry*) b)->name, 16);
+}
+
+// an object being compressed by one of the backup threads
+struct compress_job {
+    char filename[500];
+    struct archive_entry entry;
+    vector<unsigned char> data;
+    // left for the thread writing the archive, which deflates it in place of data
+    bool stream;
+    // 0, or the errno the job failed with
+    int status;
+};
+
+// batch of jobs the backup threads take work from
+struct compress_batch {
+    vector<struct compress_job>* jobs;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+// deflates a whole object into job->data, or appends it to out_fd if that isn't -1,
+// filling in the entry's lengths and digest
+int compress_object(struct compress_job* job, int out_fd) {
+    int open_fd = open(job->filename, O_RDONLY);
+    if (open_fd < 0) {
+        return -1;
+    }
+    
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit(&stream, Z_BEST_SPEED) != Z_OK) {
+        close(open_fd);
+        return -1;
+    }
+    
+    unsigned char in_buffer[BUFFER_SIZE];
+    unsigned char out_buffer[BUFFER_SIZE];
+    int flush = Z_NO_FLUSH;
+    
+    while (flush != Z_FINISH) {
+        int size = read(open_fd, in_buffer, BUFFER_SIZE);
+        if (size < 0) {
+            deflateEnd(&stream);
+            close(open_fd);
+            return -1;
+        }
+        
+        job->entry.digest = fnv1a(job->entry.digest, in_buffer, size);
+        job->entry.raw_length += size;
+        
+        flush = size == 0 ? Z_FINISH : Z_NO_FLUSH;
+        stream.next_in = in_buffer;
+        stream.avail_in = size;
+        do {
+            stream.next_out = out_buffer;
+            stream.avail_out = BUFFER_SIZE;
+            deflate(&stream, flush);
+            size_t have = BUFFER_SIZE - stream.avail_out;
+            if (out_fd < 0) {
+                job->data.insert(job->data.end(), out_buffer, out_buffer + have);
+            } else if (write_all(out_fd, (char*) out_buffer, have) < 0) {
+                deflateEnd(&stream);
+                close(open_fd);
+                return -1;
+            }
+            job->entry.length += have;
+        } while (stream.avail_out == 0);
+    }
+    
+    deflateEnd(&stream);
+    close(open_fd);
+    
+    return 0;
+}
+
+void* compress_worker(void* data) {
+    struct compress_batch* batch = (struct compress_batch*) data;
+    while (1) {
+        pthread_mutex_lock(&batch->lock);
+        size_t i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        
+        if (i >= batch->jobs->size()) {
+            return NULL;
+        }
+        
+        struct compress_job* job = &(*batch->jobs)[i];
+        if (job->stream) {
+            continue;
+        }
+        errno = 0;
+        if (compress_object(job, -1) < 0) {
+            job->status = errno != 0 ? errno : EIO;
+        }
+    }
+}
+
+// compresses a batch of jobs, spread over one thread per core
+void compress_jobs(vector<struct compress_job>* jobs) {
+    struct compress_batch batch;
+    batch.jobs = jobs;
+    batch.next = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+    
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > (long) jobs->size()) {
+        num_threads = jobs->size();
+    }
+    
+    vector<pthread_t> threads;
+    for (long i = 1; i < num_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, &compress_worker, &batch) == 0) {
+            threads.push_back(thread);
+        }
+    }
+    
+    // this thread does its share of the work too
+    compress_worker(&batch);
+    
+    for (size_t i = 0; i < threads.size(); i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&batch.lock);
+}
+
+// appends the data of one object to the archive uncompressed
+int write_raw_entry(int archive_fd, const char* data_filename, struct archive_entry* entry) {
+    int open_fd = open(data_filename, O_RDONLY);
+    if (open_fd < 0) {
+        return -1;
+    }
+    
+    unsigned char copy_buffer[BUFFER_SIZE];
+    int size = read(open_fd, copy_buffer, BUFFER_SIZE);
+    while (size > 0) {
+        if (write_all(archive_fd, (char*) copy_buffer, size) < 0) {
+            size = -1;
+            break;
+        }
+        entry->digest = fnv1a(entry->digest, copy_buffer, size);
+        entry->length += size;
+        size = read(open_fd, copy_buffer, BUFFER_SIZE);
+    }
+    close(open_fd);
+    
+    entry->raw_length = entry->length;
+    return size < 0 ? -1 : 0;
+}
+
+// packs every object in DATA_DIR into a single archive file
+int write_backup_archive(const char* archive_name) {
+    DIR *directory = opendir(DATA_DIR);
+    if (directory == NULL) {
+        return -1;
+    }
+    
+    // index entries are written in sorted order so readers can binary search them
+    vector<string> names;
+    struct dirent *file;
+    while ((file = readdir(directory))) {
+        if (is_valid_name(file->d_name) && file->d_type != DT_DIR) {
+            names.push_back(file->d_name);
+        }
+    }
+    closedir(directory);
+    sort(names.begin(), names.end());
+    
+    // the archive only shows up under its real name once it is complete
+    char temp_name[500];
+    snprintf(temp_name, 500, ".%s.tmp", archive_name);
+    int archive_fd = open(temp_name, O_RDWR | O_CREAT | O_TRUNC, 0667);
+    if (archive_fd < 0) {
+        return -1;
+    }
+    
+    vector<struct archive_entry> entries;
+    uint64_t offset = 0;
+    size_t i = 0;
+    while (i < names.size()) {
+        // gathers the next batch of objects
+        vector<struct compress_job> jobs;
+        uint64_t batch_size = 0;
+        while (i < names.size() && (jobs.empty() || batch_size < COMPRESS_BATCH_SIZE)) {
+            struct compress_job job;
+            snprintf(job.filename, 500, "%s/%s", DATA_DIR, names[i].c_str());
+            memset(&job.entry, 0, sizeof(job.entry));
+            strncpy(job.entry.name, names[i].c_str(), sizeof(job.entry.name) - 1);
+            job.entry.name[sizeof(job.entry.name) - 1] = '\0';
+            job.entry.digest = DIGEST_SEED;
+            job.entry.codec = compress_backups ? CODEC_DEFLATE : CODEC_NONE;
+            job.stream = false;
+            job.status = 0;
+            
+            // big objects don't count towards the batch, they never sit in memory
+            struct stat st;
+            if (stat(job.filename, &st) == 0) {
+                job.stream = compress_backups && st.st_size >= COMPRESS_STREAM_SIZE;
+                batch_size += job.stream ? 0 : st.st_size;
+            }
+            jobs.push_back(job);
+            i++;
+        }
+        
+        if (compress_backups) {
+            compress_jobs(&jobs);
+        }
+        
+        // writes out the batch in order
+        for (size_t j = 0; j < jobs.size(); j++) {
+            struct compress_job* job = &jobs[j];
+            job->entry.offset = offset;
+            
+            if (job->stream) {
+                errno = 0;
+                if (compress_object(job, archive_fd) < 0) {
+                    job->status = errno != 0 ? errno : EIO;
+                }
+            } else if (compress_backups) {
+                if (job->status == 0 && write_all(archive_fd, (char*) job->data.data(), job->data.size()) < 0) {
+                    job->status = EIO;
+                }
+            } else {
+                errno = 0;
+                if (write_raw_entry(archive_fd, job->filename, &job->entry) < 0) {
+                    job->status = errno != 0 ? errno : EIO;
+                }
+            }
+            
+            // objects deleted since the scan are left out
+            if (job->status == ENOENT) {
+                continue;
+            }
+            if (job->status != 0) {
+                close(archive_fd);
+                unlink(temp_name);
+                return -1;
+            }
+            
+            offset += job->entry.length;
+            entries.push_back(job->entry);
+        }
+    }
+    
+    // pads the data out so the index is aligned once the archive is mapped
+    char padding[alignof(struct archive_entry)] = {0};
+    size_t padding_size = (alignof(struct archive_entry) - offset % alignof(struct archive_entry)) % alignof(struct archive_entry);
+    
+    struct archive_footer footer;
+    memcpy(footer.magic, ARCHIVE_MAGIC, sizeof(footer.magic));
+    footer.index_offset = offset + padding_size;
+    footer.num_entries = entries.size();
+    
+    if (write_all(archive_fd, padding, padding_size) < 0 ||
+        write_all(archive_fd, (char*) entries.data(), entries.size() * sizeof(struct archive_entry)) < 0 ||
+        write_all(archive_fd, (char*) &footer, sizeof(footer)) < 0 ||
+        fsync(archive_fd) < 0) {
+        close(archive_fd);
+        unlink(temp_name);
+        return -1;
+    }
+    close(archive_fd);
+    
+    return rename(temp_name, archive_name);
+}
+
+// writes the original data of an archive entry to out_fd, inflating it if it was compressed,
+// and fails if it doesn't match the entry's digest. with out_fd -1 the entry is only checked
+int write_archive_entry(struct archive* arc, struct archive_entry* entry, int out_fd) {
+    if (entry->codec == CODEC_NONE) {
+        if (entry->length != entry->raw_length ||
+            fnv1a(DIGEST_SEED, (unsigned char*) arc->map + entry->offset, entry->length) != entry->digest) {
+            return -1;
+        }
+        return out_fd < 0 ? 0 : write_all(out_fd, arc->map + entry->offset, entry->length);
+    } else if (entry->codec != CODEC_DEFLATE) {
+        return -1;
+    }
+    
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK) {
+        return -1;
+    }
+    
+    unsigned char out_buffer[BUFFER_SIZE];
+    uint64_t consumed = 0;
+    uint64_t total = 0;
+    uint32_t digest = DIGEST_SEED;
+    int ret = Z_OK;
+    
+    while (ret != Z_STREAM_END) {
+        // avail_in is only 32 bits wide, so feed huge entries in pieces
+        if (stream.avail_in == 0) {
+            uint64_t left = entry->length - consumed;
+            if (left == 0) {
+                break;
+            }
+            stream.next_in = (Bytef*) (arc->map + entry->offset + consumed);
+            stream.avail_in = left > (1u << 30) ? (1u << 30) : left;
+            consumed += stream.avail_in;
+        }
+        
+        stream.next_out = out_buffer;
+        stream.avail_out = BUFFER_SIZE;
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            break;
+        }
+        
+        size_t have = BUFFER_SIZE - stream.avail_out;
+        if (out_fd >= 0 && write_all(out_fd, (char*) out_buffer, have) < 0) {
+            ret = Z_ERRNO;
+            break;
+        }
+        digest = fnv1a(digest, out_buffer, have);
+        total += have;
+    }
+    
+    inflateEnd(&stream);
+    return (ret == Z_STREAM_END && total == entry->raw_length && digest == entry->digest) ? 0 : -1;
+}
+
+// maps an archive file into memory and checks that its footer is valid
+int open_archive(const char* archive_name, struct archive* arc) {
+    arc->fd = open(archive_name, O_RDONLY);
+    if (arc->fd < 0) {
+        return -1;
+    }
+    
+    struct stat st;
+    if (fstat(arc->fd, &st) < 0 || (size_t) st.st_size < sizeof(struct archive_footer)) {
+        close(arc->fd);
+        errno = EINVAL;
+        return -1;
+    }
+    
+    arc->map_size = st.st_size;
+    arc->map = (char*) mmap(NULL, arc->map_size, PROT_READ, MAP_SHARED, arc->fd, 0);
+    if (arc->map == MAP_FAILED) {
+        close(arc->fd);
+        return -1;
+    }
+    
+    struct archive_footer* footer = (struct archive_footer*) (arc->map + arc->map_size - sizeof(struct archive_footer));
+    uint64_t index_end = arc->map_size - sizeof(struct archive_footer);
+    if (memcmp(footer->magic, ARCHIVE_MAGIC, sizeof(footer->magic)) != 0 || footer->index_offset > index_end ||
+        footer->index_offset % alignof(struct archive_entry) != 0 ||
+        footer->num_entries != (index_end - footer->index_offset) / sizeof(struct archive_entry)) {
+        munmap(arc->map, arc->map_size);
+        close(arc->fd);
+        errno = EINVAL;
+        return -1;
+    }
+    
+    arc->index_offset = footer->index_offset;
+    arc->entries = (struct archive_entry*) (arc->map + footer->index_offset);
+    arc->num_entries = footer->num_entries;
+    
+    return 0;
+}
+
+void close_archive(struct archive* arc) {
+    munmap(arc->map, arc->map_size);
+    close(arc->fd);
+}
+
+// an entry's data has to lie in the data section, before the index
+bool archive_entry_in_bounds(struct archive* arc, struct archive_entry* entry) {
+    return entry->offset <= arc->index_offset && entry->length <= arc->index_offset - entry->offset;
+}
+
+// binary searches the archive index, returns NULL if name isn't in the archive
+struct archive_entry* find_archive_entry(struct archive* arc, const char* name) {
+    struct archive_entry key;
+    memset(&key, 0, sizeof(key));
+    strncpy(key.name, name, sizeof(key.name) - 1);
+    key.name[sizeof(key.name) - 1] = '\0';
+    
+    struct archive_entry* entry = (struct archive_entry*) bsearch(&key, arc->entries, arc->num_entries,
+        sizeof(struct archive_entry), compare_archive_entries);
+    if (entry == NULL || !archive_entry_in_bounds(arc, entry)) {
+        return NULL;
+    }
+    
+    return entry;
+}
+
+// fills STAGING_DIR with the objects of an archive, each written straight out of the mapping
+// (or inflated from it when the archive is compressed)
+int clone_archive(const char* archive_name) {
+    struct archive arc;
+    if (open_archive(archive_name, &arc) < 0) {
+        return -1;
+    }
+    
+    remove_tree(STAGING_DIR);
+    if (mkdir(STAGING_DIR, 0777) < 0) {
+        close_archive(&arc);
+        return -1;
+    }
+    
+    for (uint64_t i = 0; i < arc.num_entries; i++) {
+        struct archive_entry* entry = &arc.entries[i];
+        char staging_filename[500];
+        snprintf(staging_filename, 500, "%s/%.10s", STAGING_DIR, entry->name);
+        
+        if (!archive_entry_in_bounds(&arc, entry)) {
+            close_archive(&arc);
+            remove_tree(STAGING_DIR);
+            return -1;
+        }
+        
+        int copy_fd = open(staging_filename, O_RDWR | O_CREAT | O_TRUNC, 0667);
+        if (copy_fd < 0) {
+            close_archive(&arc);
+            remove_tree(STAGING_DIR);
+            return -1;
+        }
+        
+        int status = write_archive_entry(&arc, entry, copy_fd);
+        close(copy_fd);
+        
+        if (status < 0) {
+            close_archive(&arc);
+            remove_tree(STAGING_DIR);
+            return -1;
+        }
+    }
+    
+    close_archive(&arc);
+    return 0;
+}
+
+// atomically exchanges STAGING_DIR with DATA_DIR, afterwards the old root is in STAGING_DIR
+int swap_data_root() {
+    if (renameat2(AT_FDCWD, STAGING_DIR, AT_FDCWD, DATA_DIR, RENAME_EXCHANGE) == 0) {
+        return 0;
+    }
+    
+    if (errno != EINVAL && errno != ENOSYS) {
+        return -1;
+    }
+    
+    // file system doesn't support RENAME_EXCHANGE, so swap with two renames instead
+    char old_root[50];
+    snprintf(old_root, 50, "%s.old", DATA_DIR);
+    remove_tree(old_root);
+    if (rename(DATA_DIR, old_root) < 0) {
+        return -1;
+    }
+    if (rename(STAGING_DIR, DATA_DIR) < 0) {
+        rename(old_root, DATA_DIR);
+        return -1;
+    }
+    
+    return rename(old_root, STAGING_DIR);
+}
+
+// creates DATA_DIR, moving over objects left in the working directory by older versions
+int init_data_root() {
+    remove_tree(STAGING_DIR);
+    
+    if (mkdir(DATA_DIR, 0777) < 0) {
+        return errno == EEXIST ? 0 : -1;
+    }
+    
+    DIR *directory = opendir(".");
+    if (directory == NULL) {
+        return -1;
+    }
+    
+    struct dirent *file;
+    while ((file = readdir(directory))) {
+        char* filename = file->d_name;
+        // skip the executable, it has a valid object name
+        if (!is_valid_name(filename) || file->d_type == DT_DIR || strcmp(filename, "httpserver") == 0) {
+            continue;
+        }
+        
+        char data_filename[500];
+        snprintf(data_filename, 500, "%s/%s", DATA_DIR, filename);
+        rename(filename, data_filename);
+    }
+    closedir(directory);
+    
+    return 0;
+}
+
+// returns the timestamp of a backup-[timestamp] dir name, or -1 if it isn't one
+long parse_backup_name(const char* name) {
+    if (strncmp(name, "backup-", 7) != 0 || name[7] == '\0') {
+        return -1;
+    }
+    
+    for (const char* p = name+7; *p != '\0'; p++) {
+        if (!isdigit(*p)) {
+            return -1;
+        }
+    }
+    
+    return strtol(name+7, NULL, 10);
+}
+
+// scans the server directory once to fill backup_index
+void init_backup_index() {
+    DIR *directory = opendir(".");
+    if (directory == NULL) {
+        return;
+    }
+    
+    struct dirent *file;
+    while ((file = readdir(directory))) {
+        long timestamp = parse_backup_name(file->d_name);
+        if ((file->d_type == DT_DIR || file->d_type == DT_REG) && timestamp >= 0) {
+            backup_index.push_back(timestamp);
+        }
+    }
+    closedir(directory);
+    
+    sort(backup_index.begin(), backup_index.end());
+}
+
+// adds a timestamp to backup_index, keeping it sorted and without duplicates
+void add_to_backup_index(long timestamp) {
+    vector<long>::iterator it = lower_bound(backup_index.begin(), backup_index.end(), timestamp);
+    if (it == backup_index.end() || *it != timestamp) {
+        backup_index.insert(it, timestamp);
+    }
+}
+
+int handle_put(int comm_fd, char buf[], char* resource_name, long content_length) {
     // removes '/'
     if (resource_name[0] == '/') {
         memmove(resource_name, resource_name+1, strlen(resource_name));
     }
 
-    // opens file name for writing
-    int open_fd;
-    
-    open_fd = open(resource_name, O_RDWR | O_CREAT | O_TRUNC, 0667);
+    // data is written to a temp file and renamed into place, so a GET or backup reading
+    // the object never sees it half written
+    char file_path[50];
+    char temp_path[50];
+    snprintf(file_path, 50, "%s/%s", DATA_DIR, resource_name);
+    snprintf(temp_path, 50, "%s/.%s.tmp", DATA_DIR, resource_name);
+
+    // an object that can't be written to isn't replaced either, and the new data keeps the
+    // permissions of the object it replaces, so one made unreadable stays that way
+    int open_fd = -1;
+    struct stat old_st;
+    bool exists = stat(file_path, &old_st) == 0;
+    if (access(file_path, W_OK) == 0 || errno == ENOENT) {
+        open_fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0667);
+    }
+    if (open_fd >= 0 && exists && fchmod(open_fd, old_st.st_mode & 07777) < 0) {
+        close(open_fd);
+        unlink(temp_path);
+        open_fd = -1;
+    }
     
     if (open_fd < 0) {
         if (errno == EACCES) {
@@ -115,55 +869,63 @@ int handle_put(int comm_fd, char buf[], char* resource_name, int content_length)
         }
     }
     
+    // the rest of the body is still read after a failed write, so the 500 goes out
+    // once the client is done sending
+    bool write_failed = false;
+    
     // if content length is specified
     if (content_length > -1) {
-        int content_size = content_length;
+        long content_size = content_length;
         // while there is still content left to be read
         while (content_size > 0) {
             // read from client
             int n = recv(comm_fd, buf, BUFFER_SIZE, 0);
             if (n <= 0) {
+                close(open_fd);
+                unlink(temp_path);
                 return -1;
             }
             // subtract number read of bytes from content_size
             content_size -= n;
 
             // write to file
-            write(open_fd, buf, n);
+            write_failed = write_failed || write_all(open_fd, buf, n) < 0;
         }
-
-        close(open_fd);
-        
-        // send 201 response
-        send_response(comm_fd, 201, content_length, resource_name);
     } else { // content length not specified, so read until EOF
         // read from client
         int n = recv(comm_fd, buf, BUFFER_SIZE, 0);
         // write to file until no bytes from input
         while (n > 0) {
             // write to file
-            write(open_fd, buf, n);
+            write_failed = write_failed || write_all(open_fd, buf, n) < 0;
             
             n = recv(comm_fd, buf, BUFFER_SIZE, 0);
         }
+    }
 
-        close(open_fd);
-        
-        // send 201 response
-        send_response(comm_fd, 201, content_length, resource_name);
+    if (close(open_fd) < 0 || write_failed || rename(temp_path, file_path) < 0) {
+        unlink(temp_path);
+        send_response(comm_fd, 500, content_length, resource_name);
+        return -1;
     }
+    
+    // send 201 response
+    send_response(comm_fd, 201, content_length, resource_name);
     return 0;
 }
 
-int handle_get(int comm_fd, char buf[], char* resource_name, int content_length) {
+int handle_get(int comm_fd, char buf[], char* resource_name, long content_length) {
     // removes '/'
     if (resource_name[0] == '/') {
         memmove(resource_name, resource_name+1, strlen(resource_name));
     }
     
+    char file_path[50];
+    snprintf(file_path, 50, "%s/%s", DATA_DIR, resource_name);
+    
     int open_fd;
     
-    open_fd = open(resource_name, O_RDONLY);
+    open_fd = open(file_path, O_RDONLY);
         
     // send appropriate response
     if (open_fd < 0) {
@@ -184,54 +946,52 @@ int handle_get(int comm_fd, char buf[], char* resource_name, int content_length)
         }
     }
     
-    int content_len = 0;
-    unsigned char* get_buffer = (unsigned char*) malloc(BUFFER_SIZE * sizeof(unsigned char));
+    long content_len = 0;
         
     // Gets Content-Length before sending a response
-    int size = read(open_fd, get_buffer, BUFFER_SIZE);
+    int size = read(open_fd, io_buffer, BUFFER_SIZE);
     
     while (size != 0) {
         if (size < 0) {
             send_response(comm_fd, 500, content_length, resource_name);
-            free(get_buffer);
+            close(open_fd);
             return -1;
         }
                             
         content_len += size;
         
-        size = read(open_fd, get_buffer, BUFFER_SIZE);
+        size = read(open_fd, io_buffer, BUFFER_SIZE);
     }
     
-    close(open_fd);
-        
-    open_fd = open(resource_name, O_RDONLY);
+    // Sends the data from the start of the file
+    lseek(open_fd, 0, SEEK_SET);
         
     // Tells client how many bytes to expect
     send_response(comm_fd, 200, content_len, resource_name);
 
     // Sends the data of size Content-Length
-    size = read(open_fd, get_buffer, BUFFER_SIZE);
+    size = read(open_fd, io_buffer, BUFFER_SIZE);
     while (size != 0) {
         if (size < 0) {
-            send_response(comm_fd, 500, content_length, resource_name);
+            close(open_fd);
             return -1;
         }
                                     
-        int n = send(comm_fd, get_buffer, size, 0);
+        int n = send(comm_fd, io_buffer, size, 0);
         if (n == -1) {
+            close(open_fd);
             return -1;
         }
         
-        size = read(open_fd, get_buffer, BUFFER_SIZE);
+        size = read(open_fd, io_buffer, BUFFER_SIZE);
     }
 
     close(open_fd);
-    free(get_buffer);
     
     return 0;
 }
 
-int handle_backup(int comm_fd, char buf[], char* resource_name, int content_length) {
+int handle_backup(int comm_fd, char buf[], char* resource_name, long content_length) {
     time_t seconds = time(NULL);
     
     // Create backup folder name
@@ -239,25 +999,54 @@ int handle_backup(int comm_fd, char buf[], char* resource_name, int content_leng
     int n = snprintf(backup_dir, 500, "backup-%ld", seconds);
     backup_dir[n] = '\0';
     
-    mkdir(backup_dir, 0777);
+    if (archive_backups) {
+        if (write_backup_archive(backup_dir) < 0) {
+            send_response(comm_fd, 500, content_length, resource_name);
+            return -1;
+        }
+        add_to_backup_index(seconds);
+        
+        // send 201 response
+        send_response(comm_fd, 201, content_length, resource_name);
+        return 0;
+    }
+    
+    // a backup that fails part way is removed, and only a complete one is indexed; a second
+    // backup in the same second refreshes the first, which is left in place if it fails
+    bool created = mkdir(backup_dir, 0777) == 0;
+    if (!created && errno != EEXIST) {
+        send_response(comm_fd, 500, content_length, resource_name);
+        return -1;
+    }
     
     DIR *directory;
     struct dirent *file;
     
-    directory = opendir(".");
+    directory = opendir(DATA_DIR);
+    if (directory == NULL) {
+        if (created) {
+            remove_tree(backup_dir);
+        }
+        send_response(comm_fd, 500, content_length, resource_name);
+        return -1;
+    }
     
-    // Goes through each file in the directory
+    // Goes through each file in the data directory
     while ((file = readdir(directory))) {
         char* filename = file->d_name;
         
-        // If filename is not a folder and length of filename is 10, add a copy to the backup folder
-        if (strlen(filename) == 10 && file->d_type != DT_DIR && (filename[8] != '.' && (filename[9] != 'o' || filename[9] != 'c'))) {
+        // If filename is a valid object name, add a copy to the backup folder
+        if (is_valid_name(filename) && file->d_type != DT_DIR) {
             char new_filename[500];
-            int n = snprintf(new_filename, 500, "%s/%s", backup_dir, filename);
-            new_filename[n] = '\0';
+            int k = snprintf(new_filename, 500, "%s/%s", backup_dir, filename);
+            new_filename[k] = '\0';
+            
+            char data_filename[500];
+            k = snprintf(data_filename, 500, "%s/%s", DATA_DIR, filename);
+            data_filename[k] = '\0';
             
             // open current file
-            int open_fd = open(filename, O_RDONLY);
+            int open_fd = open(data_filename, O_RDONLY);
             
             if (open_fd < 0 && errno == EACCES) {
                 continue;
@@ -266,26 +1055,33 @@ int handle_backup(int comm_fd, char buf[], char* resource_name, int content_leng
             // create the new file in the backup directory
             int new_open_fd = open(new_filename, O_RDWR | O_CREAT | O_TRUNC, 0667);
             
-            unsigned char* get_buffer = (unsigned char*) malloc(BUFFER_SIZE * sizeof(unsigned char));
-            
-            int size = read(open_fd, get_buffer, BUFFER_SIZE);
-            while (size != 0) {
-                if (size < 0) {
-                    send_response(comm_fd, 500, content_length, resource_name);
-                    free(get_buffer);
-                    return -1;
+            int size = open_fd < 0 || new_open_fd < 0 ? -1 : read(open_fd, io_buffer, BUFFER_SIZE);
+            while (size > 0) {
+                if (write_all(new_open_fd, (char*) io_buffer, size) < 0) {
+                    size = -1;
+                    break;
                 }
                 
-                write(new_open_fd, get_buffer, size);
-                
-                size = read(open_fd, get_buffer, BUFFER_SIZE);
+                size = read(open_fd, io_buffer, BUFFER_SIZE);
             }
             
-            free(get_buffer);
-            close(open_fd);
-            close(new_open_fd);
+            if (open_fd >= 0) {
+                close(open_fd);
+            }
+            if (new_open_fd >= 0 && close(new_open_fd) < 0) {
+                size = -1;
+            }
+            if (size < 0) {
+                closedir(directory);
+                if (created) {
+                    remove_tree(backup_dir);
+                }
+                send_response(comm_fd, 500, content_length, resource_name);
+                return -1;
+            }
         }
     }
+    add_to_backup_index(seconds);
     
     // send 201 response
     send_response(comm_fd, 201, content_length, resource_name);
@@ -294,52 +1090,24 @@ int handle_backup(int comm_fd, char buf[], char* resource_name, int content_leng
     return 0;
 }
 
-int handle_recovery(int comm_fd, char buf[], char* resource_name, int content_length) {
-    DIR *directory;
-    struct dirent *file;
+int handle_recovery(int comm_fd, char buf[], char* resource_name, long content_length) {
+    // backup can be a directory or an archive, so open it without assuming which
+    int backup_fd;
     char backup_dir[500];
 
     // get the most recent backup directory
     if (strlen(resource_name) == 2) {
-        DIR *curdir;
-        struct dirent *curdirfile;
-
-        curdir = opendir(".");
         long int timestamp = 0;
-
-        // Goes through each file in the directory
-        while ((curdirfile = readdir(curdir))) {
-            char* filename = curdirfile->d_name;
-            // skip . and ..
-            if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0 || curdirfile->d_type != DT_DIR || strlen(filename) < 8) {
-                continue;
-            }
-            
-            char substr[10];
-            strncpy(substr, filename, 7);
-            substr[7] = '\0';
-            
-            if (strcmp(substr, "backup-") == 0) {
-                int k = strlen(filename);
-                k = k-7;
-                char time_str[20];
-                strncpy(time_str, filename+7, k);
-                char* eptr;
-                long int cur_timestamp = strtol(time_str, &eptr, 10);
-                if (cur_timestamp > timestamp) {
-                    timestamp = cur_timestamp;
-                }
-            }
+        if (!backup_index.empty()) {
+            timestamp = backup_index.back();
         }
-        
-        closedir(curdir);
 
         int n = snprintf(backup_dir, 500, "./backup-%ld", timestamp);
         backup_dir[n] = '\0';
 
-        directory = opendir(backup_dir);
+        backup_fd = open(backup_dir, O_RDONLY);
         
-        if (directory == NULL) {
+        if (backup_fd < 0) {
             if (errno == ENOENT) {
                 // directory doesn't exist
                 send_response(comm_fd, 404, content_length, resource_name);
@@ -370,9 +1138,9 @@ int handle_recovery(int comm_fd, char buf[], char* resource_name, int content_le
         int n = snprintf(backup_dir, 500, "./backup-%s", resource_name);
         backup_dir[n] = '\0';
         
-        directory = opendir(backup_dir);
+        backup_fd = open(backup_dir, O_RDONLY);
 
-        if (directory == NULL) {
+        if (backup_fd < 0) {
             if (errno == ENOENT) {
                 // directory doesn't exist
                 send_response(comm_fd, 404, content_length, resource_name);
@@ -388,146 +1156,206 @@ int handle_recovery(int comm_fd, char buf[], char* resource_name, int content_le
         }
     }
 
-    // Goes through each file in the backup directory
-    while ((file = readdir(directory))) {
-        char* filename = file->d_name;
-        // skip . and ..
-        if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) {
-            continue;
-        }
-        
-        // copy file in backup dir into server dir
-        char backup_filename[500];
-        int n = snprintf(backup_filename, 500, "%s/%s", backup_dir, filename);
-        backup_filename[n] = '\0';
-
-        int backup_fd = open(backup_filename, O_RDONLY);
-        int copy_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0667);
-
-        unsigned char* get_buffer = (unsigned char*) malloc(BUFFER_SIZE * sizeof(unsigned char));
-        
-        int size = read(backup_fd, get_buffer, BUFFER_SIZE);
-        while (size != 0) {
-            if (size < 0) {
-                break;
-            }
-            
-            write(copy_fd, get_buffer, size);
-            
-            size = read(backup_fd, get_buffer, BUFFER_SIZE);
-        }
-        
-        free(get_buffer);
-        close(backup_fd);
-        close(copy_fd);
+    struct stat st;
+    fstat(backup_fd, &st);
+    close(backup_fd);
+    
+    // builds the recovered root next to the live one, then swaps them in one step
+    // so clients never see a half restored state; building it takes a copy (or reflink)
+    // per object, only the swap itself is constant time, since swapping in the backup
+    // itself would leave later PUTs changing the backup
+    int cloned = S_ISDIR(st.st_mode) ? clone_backup(backup_dir) : clone_archive(backup_dir);
+    if (cloned < 0 || swap_data_root() < 0) {
+        send_response(comm_fd, 500, content_length, resource_name);
+        return -1;
     }
     
     // send 201 response
     send_response(comm_fd, 201, content_length, resource_name);
     
-    closedir(directory);
+    // old root was swapped into the staging dir, so clean it up
+    remove_tree(STAGING_DIR);
     return 0;
 }
 
-int handle_list(int comm_fd, char buf[], char* resource_name, int content_length) {
-    DIR *dir;
-    struct dirent *file;
-    bool contains_no_backups = true;
-    int content_len = 0;
-
-    dir = opendir(".");
-
-    // Goes through each file in the directory and count the content length
-    while ((file = readdir(dir))) {
-        char* filename = file->d_name;
-
-        // skip . and .., and skip non-dirs, as well as dirs with name < length 8
-        if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0 || file->d_type != DT_DIR || strlen(filename) < 8) {
-            continue;
-        }
-        
-        char substr[10];
-        strncpy(substr, filename, 7);
-        substr[7] = '\0';
-        
-        // finds dirs starting with 'backup-'
-        if (strcmp(substr, "backup-") == 0) {
-            int k = strlen(filename);
-            k = k-7;
-            char time_str[20];
-            strncpy(time_str, filename+7, k);
-            time_str[k] = '\0';
-            bool is_valid_timestamp = true;
-            // gets rid of invalid backup timestamp strings
-            for (int i = 0; i < strlen(time_str); i++) {
-                if (!isdigit(time_str[i])) {
-                    is_valid_timestamp = false;
-                    break;
-                }
+int handle_list(int comm_fd, char buf[], char* resource_name, long content_length) {
+    // optional time range, /l?from=[timestamp]&to=[timestamp]
+    long from = 0;
+    long to = -1;
+    char* query = strchr(resource_name, '?');
+    if (query != NULL) {
+        char* param = strtok(query+1, "&");
+        while (param != NULL) {
+            char* eptr;
+            if (strncmp(param, "from=", 5) == 0 && isdigit(param[5])) {
+                from = strtol(param+5, &eptr, 10);
+            } else if (strncmp(param, "to=", 3) == 0 && isdigit(param[3])) {
+                to = strtol(param+3, &eptr, 10);
+            } else {
+                send_response(comm_fd, 400, 0, resource_name);
+                return -1;
             }
             
-            if (is_valid_timestamp) {
-                char timestamp[20];
-                int n = snprintf(timestamp, 20, "%s\n", filename+7);
-                content_len += n;
-                contains_no_backups = false;
+            if (*eptr != '\0') {
+                send_response(comm_fd, 400, 0, resource_name);
+                return -1;
             }
+            param = strtok(NULL, "&");
         }
     }
-    closedir(dir);
 
-    if (contains_no_backups) {
-        // send 200 response with content length: 0 if no backups are available
-        send_response(comm_fd, 200, 0, resource_name);
-    } else {
-        send_response(comm_fd, 200, content_len, resource_name);
-        
-        dir = opendir(".");
+    vector<long>::iterator first = lower_bound(backup_index.begin(), backup_index.end(), from);
+    vector<long>::iterator last = backup_index.end();
+    if (to >= 0) {
+        last = upper_bound(first, backup_index.end(), to);
+    }
 
-        // Goes through each file in the directory and sends the timestamps
-        while ((file = readdir(dir))) {
-            char* filename = file->d_name;
+    // builds the timestamps list, then sends the header and list together
+    string body;
+    char timestamp[24];
+    for (vector<long>::iterator it = first; it < last; it++) {
+        int n = snprintf(timestamp, 24, "%ld\n", *it);
+        body.append(timestamp, n);
+    }
 
-            // skip . and .., and skip non-dirs, as well as dirs with name < length 8
-            if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0 || file->d_type != DT_DIR || strlen(filename) < 8) {
-                continue;
-            }
-            
-            char substr[10];
-            strncpy(substr, filename, 7);
-            substr[7] = '\0';
-            
-            // finds dirs starting with 'backup-'
-            if (strcmp(substr, "backup-") == 0) {
-                int k = strlen(filename);
-                k = k-7;
-                
-                char time_str[20];
-                strncpy(time_str, filename+7, k);
-                time_str[k] = '\0';
-                bool is_valid_timestamp = true;
-                // gets rid of invalid backup timestamp strings
-                for (int i = 0; i < strlen(time_str); i++) {
-                    if (!isdigit(time_str[i])) {
-                        is_valid_timestamp = false;
-                        break;
-                    }
-                }
+    char head[100];
+    int k = snprintf(head, 100, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", body.size());
+    string response(head, k);
+    response += body;
 
-                if (is_valid_timestamp) {
-                    char timestamp[20];
-                    int n = snprintf(timestamp, 20, "%s\n", filename+7);
-                    int j = send(comm_fd, timestamp, strlen(timestamp), 0);
-                }
-            }
+    size_t sent = 0;
+    while (sent < response.size()) {
+        int n = send(comm_fd, response.data()+sent, response.size()-sent, 0);
+        if (n < 0) {
+            return -1;
         }
-        closedir(dir);
-        
+        sent += n;
     }
 
     return 0;
 }
 
+int handle_version(int comm_fd, char* resource_name, long content_length) {
+    // splits /v/[timestamp]/[name] into its timestamp and name
+    char* time_str = resource_name+3;
+    char* name = strchr(time_str, '/');
+    if (name == NULL || name == time_str) {
+        send_response(comm_fd, 400, 0, resource_name);
+        return -1;
+    }
+    *name = '\0';
+    name++;
+    
+    for (char* p = time_str; *p != '\0'; p++) {
+        if (!isdigit(*p)) {
+            send_response(comm_fd, 400, 0, resource_name);
+            return -1;
+        }
+    }
+    if (!is_valid_name(name)) {
+        send_response(comm_fd, 400, 0, resource_name);
+        return -1;
+    }
+    
+    long timestamp = strtol(time_str, NULL, 10);
+    if (!binary_search(backup_index.begin(), backup_index.end(), timestamp)) {
+        send_response(comm_fd, 404, content_length, name);
+        return -1;
+    }
+    
+    // "backup-" and at most 20 digits
+    char backup_name[30];
+    snprintf(backup_name, sizeof(backup_name), "backup-%ld", timestamp);
+    
+    struct stat st;
+    if (stat(backup_name, &st) < 0) {
+        send_response(comm_fd, 404, content_length, name);
+        return -1;
+    }
+    
+    // finds where the object lives, either a whole file in a backup directory
+    // or a slice of an archive
+    int open_fd;
+    off_t offset = 0;
+    size_t length;
+    struct archive arc;
+    bool is_archive = !S_ISDIR(st.st_mode);
+    
+    if (is_archive) {
+        if (open_archive(backup_name, &arc) < 0) {
+            send_response(comm_fd, 500, content_length, name);
+            return -1;
+        }
+        
+        struct archive_entry* entry = find_archive_entry(&arc, name);
+        if (entry == NULL) {
+            close_archive(&arc);
+            send_response(comm_fd, 404, content_length, name);
+            return -1;
+        }
+        
+        // the 200 can't be taken back once the body is going out, so the entry is
+        // checked (inflated into nowhere if it's compressed) before it is sent
+        if (write_archive_entry(&arc, entry, -1) < 0) {
+            close_archive(&arc);
+            send_response(comm_fd, 500, content_length, name);
+            return -1;
+        }
+        
+        // compressed objects have to be inflated on the way out, so they can't use sendfile
+        if (entry->codec != CODEC_NONE) {
+            send_response(comm_fd, 200, entry->raw_length, name);
+            int status = write_archive_entry(&arc, entry, comm_fd);
+            close_archive(&arc);
+            return status;
+        }
+        
+        open_fd = arc.fd;
+        offset = entry->offset;
+        length = entry->length;
+    } else {
+        char backup_filename[500];
+        snprintf(backup_filename, 500, "%s/%s", backup_name, name);
+        open_fd = open(backup_filename, O_RDONLY);
+        
+        if (open_fd < 0) {
+            if (errno == ENOENT) {
+                send_response(comm_fd, 404, content_length, name);
+            } else if (errno == EACCES) {
+                send_response(comm_fd, 403, content_length, name);
+            } else {
+                send_response(comm_fd, 500, content_length, name);
+            }
+            return -1;
+        }
+        
+        fstat(open_fd, &st);
+        length = st.st_size;
+    }
+    
+    // Tells client how many bytes to expect
+    send_response(comm_fd, 200, length, name);
+    
+    // sends straight from the page cache to the socket
+    int status = 0;
+    while (length > 0) {
+        ssize_t n = sendfile(comm_fd, open_fd, &offset, length);
+        if (n <= 0) {
+            status = -1;
+            break;
+        }
+        length -= n;
+    }
+    
+    if (is_archive) {
+        close_archive(&arc);
+    } else {
+        close(open_fd);
+    }
+    
+    return status;
+}
+
 // source: section recording
 unsigned long getaddr(char* name) {
     unsigned long res;
@@ -553,18 +1381,37 @@ int main(int argc, char* argv[]) {
     char buf[BUFFER_SIZE];
     unsigned short port_number;
     char* address;
-    if (argc == 2) {
+    extern int optind;
+    int c;
+    
+    // parses command line options -a and -z
+    while ((c = getopt(argc, argv, "az")) != -1) {
+        switch (c) {
+            case 'a':
+                archive_backups = true;
+                break;
+            case 'z':
+                archive_backups = true;
+                compress_backups = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s <address> [port number] [-a] [-z]\n", argv[0]);
+                exit(1);
+        }
+    }
+    
+    if (argc - optind == 1) {
         // only specified hostname/ipaddress
-        address = argv[1];
+        address = argv[optind];
         port_number = 80;
     }
-    else if (argc == 3) {
+    else if (argc - optind == 2) {
         // both hostname/ipaddress and port specified
-        address = argv[1];
-        port_number = atoi(argv[2]);
+        address = argv[optind];
+        port_number = atoi(argv[optind+1]);
     }
     else {
-        fprintf(stderr, "Usage: %s <address> [port number]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <address> [port number] [-a] [-z]\n", argv[0]);
         exit(1);
     }
 
@@ -595,6 +1442,12 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
+    if (init_data_root() < 0) {
+        warn("%s\n", DATA_DIR);
+        exit(1);
+    }
+    init_backup_index();
+
     while (1) {
         // extracts the first connection request on the queue of pending connections for the listening socket
         int comm_fd = accept(listen_fd, NULL, NULL);
@@ -611,6 +1464,7 @@ int main(int argc, char* argv[]) {
              * 1: backup
              * 2: recovery
              * 3: list
+             * 4: GET from a backup
              */
             int cmd_type = 0;
             
@@ -623,15 +1477,18 @@ int main(int argc, char* argv[]) {
             // parse the GET/PUT input
             struct header head = parseHeader(buf);
             
-            // first 3 if statements checks for /b, /r, /l
+            // first 4 if statements checks for /b, /r, /l, /v
             if (strcmp(head.command, "GET") == 0 && strlen(head.resource_name) == 2 && head.resource_name[1] == 'b') {
                 cmd_type = 1;
             } else if (strcmp(head.command, "GET") == 0 &&
                 ((strlen(head.resource_name) == 2 && head.resource_name[1] == 'r') ||
                 (head.resource_name[1] == 'r' && head.resource_name[2] == '/' && strlen(head.resource_name) > 3))) { // in the case of /r/[timestamp]
                 cmd_type = 2;
-            } else if (strcmp(head.command, "GET") == 0 && strlen(head.resource_name) == 2 && head.resource_name[1] == 'l') {
+            } else if (strcmp(head.command, "GET") == 0 && head.resource_name[1] == 'l' &&
+                (strlen(head.resource_name) == 2 || head.resource_name[2] == '?')) { // in the case of /l?from=[timestamp]&to=[timestamp]
                 cmd_type = 3;
+            } else if (strcmp(head.command, "GET") == 0 && strncmp(head.resource_name, "/v/", 3) == 0) { // in the case of /v/[timestamp]/[name]
+                cmd_type = 4;
             } else {
                 // check if resource name is valid
                 // length must = 11 (including the '/')
@@ -659,26 +1516,28 @@ int main(int argc, char* argv[]) {
             
             // if put : save file and send status
             if (strcmp(head.command, "PUT") == 0) {
-                int n = handle_put(comm_fd, buf, head.resource_name, head.content_length);
-                if (n != 0) {
+                int status = handle_put(comm_fd, buf, head.resource_name, head.content_length);
+                if (status != 0) {
                     break;
                 }
             }
             // if get : retrieve file and send status and file
             else if (strcmp(head.command, "GET") == 0) {
-                int n;
+                int status;
                 
                 if (cmd_type == 1) {
-                    n = handle_backup(comm_fd, buf, head.resource_name, head.content_length);
+                    status = handle_backup(comm_fd, buf, head.resource_name, head.content_length);
                 } else if (cmd_type == 2) {
-                    n = handle_recovery(comm_fd, buf, head.resource_name, head.content_length);
+                    status = handle_recovery(comm_fd, buf, head.resource_name, head.content_length);
                 } else if (cmd_type == 3) {
-                    n = handle_list(comm_fd, buf, head.resource_name, head.content_length);
+                    status = handle_list(comm_fd, buf, head.resource_name, head.content_length);
+                } else if (cmd_type == 4) {
+                    status = handle_version(comm_fd, head.resource_name, head.content_length);
                 } else {
-                    n = handle_get(comm_fd, buf, head.resource_name, head.content_length);
+                    status = handle_get(comm_fd, buf, head.resource_name, head.content_length);
                 }
                 
-                if (n != 0) {
+                if (status != 0) {
                     break;
                 }
             } else {